@@ -29,10 +29,10 @@ class AssembleError(Exception):
     pass
 
 def is_reg(value):
-    return typeof(value) == tuple and value[0] == 'reg'
+    return type(value) == tuple and value[0] == 'reg'
 
 def is_mem(value):
-    return typeof(value) == tuple and value[0] == 'ref'
+    return type(value) == tuple and value[0] == 'ref'
 
 def table(instruction):
     def decorator(func):
@@ -15,13 +15,78 @@
 #define INTERRUPT_ENABLE_NEXT 128
 #define WAIT_FLAG 256
 
+// lf_op when there's no ALU result waiting to be turned into flags
+#define LF_NONE 0xff
+
 #define ROM_SIZE 65536
+#define RAM_SIZE 16384
 
 #define SCALE 4
 
+// the biggest the screen gets (SCRW x SCRH are the real size)
+#define MAX_SCRW 240
+#define MAX_SCRH 176
+
 #define VBLANK_INTERRUPT 0x80
 #define HBLANK_INTERRUPT 0x88
 #define KEYBOARD_INTERRUPT 0x90
+#define TIMER_INTERRUPT 0x98
+#define DMA_INTERRUPT 0xa0
+
+// Interrupt controller bits ($ff04, $ff05). They're taken in the order
+// vblank, hblank, timer, DMA, keyboard.
+#define IRQ_VBLANK 0x01
+#define IRQ_HBLANK 0x02
+#define IRQ_KEY 0x04
+#define IRQ_TIMER 0x08
+#define IRQ_DMA 0x10
+#define IRQ_ALL (IRQ_VBLANK | IRQ_HBLANK | IRQ_KEY | IRQ_TIMER | IRQ_DMA)
+
+// $ff0a, timer control
+// count down (writing this bit restarts from the reload value)
+#define TIMER_RUN 0x01
+// start again from the reload value after interrupting, rather than
+// stopping
+#define TIMER_REPEAT 0x02
+// bits 2-3: 1, 16, 256 or 4096 cycles per tick
+#define TIMER_PRESCALE(ctrl) (1u << (((ctrl) >> 2 & 3) * 4))
+
+// $ff19, DMA control
+// do the transfer (reads back as 0; it's done by the time the next
+// instruction runs)
+#define DMA_START 0x01
+// write the fill value ($ff18) instead of copying
+#define DMA_FILL 0x02
+// raise the DMA interrupt when it's done
+#define DMA_IRQ 0x04
+
+// Where DMA can write to ($ff13; see dma_region)
+enum {
+    DMA_PATTERN,    // the whole pattern table (not just the windows)
+    DMA_BG_MAP,
+    DMA_FG_MAP,
+    DMA_OAM,
+    DMA_PALETTE,
+    N_DMA_DESTS
+};
+
+// how many keys can be waiting to be read
+#define KEY_FIFO_SIZE 32
+
+// $d7f8, HBLANK control
+// raise HBLANK interrupts at all
+#define HBLANK_ENABLE 0x01
+// ...but only after the line in $d7f7 (the line compare register)
+#define HBLANK_COMPARE 0x02
+
+// Video timing, in CPU cycles. Every frame is LINES_PER_FRAME lines
+// long; the first SCRH of them get drawn (each one followed by an
+// HBLANK interrupt) and the rest are vertical blank. At 60 frames a
+// second this makes the CPU an 8.064 MHz part.
+#define CYCLES_PER_LINE 672
+#define LINES_PER_FRAME 200
+#define CYCLES_PER_FRAME (CYCLES_PER_LINE * LINES_PER_FRAME)
+#define FRAMES_PER_SECOND 60
 
 // Number of palettes.
 #define N_PALETTES 8
@@ -47,6 +112,8 @@ int debug_counter = 0;
 int instr_counter = 0;
 #endif
 
+typedef uint64_t u64;
+
 typedef uint32_t u32;
 
 typedef int32_t i32;
@@ -64,64 +131,172 @@ SDL_Surface *screen;
 SDL_Texture *texture;
 SDL_Renderer *renderer;
 
+// The picture being drawn, in the texture's pixel format (SCRW pixels
+// per line; big enough for either screen size). scanline draws into
+// it and present_frame hands it to SDL once a frame.
+u32 framebuffer[MAX_SCRW * MAX_SCRH];
+
 int widescreen = 1;
 int SCRW;
 int SCRH;
 
 char rom_title[31];
 
-// if we fail to do the key interrupt once because
-// we're already in an interrupt, store it here for a sec
-// and try again
-u8 backup_key = 0xFF;
+// How many cycles the CPU gets to run between looks at the
+// window. (--slice <n>)
+long slice_size = 4096;
 
-// uh, this can be arbitrarily big I guess
-// I'll probably heap-allocate this later
-unsigned char rom_buffer[ROM_SIZE];
+// Spot loops that can't do anything until an interrupt comes along
+// (jumps to self, polling something only an interrupt changes) and
+// skip ahead instead of running them. (--no-idle-skip turns it off)
+int idle_skip = 1;
 
-// Here's our machine!
-typedef struct interp {
-    // 12 general use registers
-    u16 a;
-    u16 b;
-    u16 c;
-    u16 d;
+// How many cycles DMA holds up the CPU for, per byte. (--dma-cycles <n>)
+int dma_cycles = 1;
 
-    u16 e;
-    u16 f;
-    u16 g;
-    u16 h;
+// Draw lines on a second thread while the CPU carries on. Only set
+// while the render thread is running. (--threaded-ppu)
+int threaded_ppu = 0;
+// look for a loop this many instructions long, at most
+#define IDLE_LOOP_MAX 16
 
-    u16 i;
-    u16 j;
-    u16 k;
-    u16 l;
+// frames nothing changed in, so they didn't get drawn (or presented)
+u64 frames_skipped = 0;
 
-    // data bank register (actually only 8 bits)
-    u16 dbr;
+// real time (ms) we started pacing from, and frames shown since
+u32 pace_start;
+u64 pace_frames = 0;
 
-    // program bank register (also only 8 bits)
-    u16 pbr;
+// uh, this can be arbitrarily big I guess
+// I'll probably heap-allocate this later
+unsigned char rom_buffer[ROM_SIZE];
 
-    // stack pointer register
-    u16 sp;
+struct interp;
+
+// One 256-byte page of the address space. Plain memory (ROM, RAM, the
+// tilemaps, OAM, palette) gets a pointer straight to where the page
+// lives; hardware registers get handlers instead. Writes to ROM go to
+// a handler too, which complains.
+typedef struct mem_page {
+    // start of the page in host memory, or NULL to use read_fn
+    u8 *read;
+    // same, for writes
+    u8 *write;
+    u8 (*read_fn)(struct interp *I, u16 addr);
+    void (*write_fn)(struct interp *I, u16 addr, u8 value);
+} mem_page;
+
+// Register ids, as they appear in instructions. a-l are the 12 general
+// use registers; dbr and pbr are the data and program bank registers
+// (actually only 8 bits each).
+enum {
+    REG_A, REG_B, REG_C, REG_D,
+    REG_E, REG_F, REG_G, REG_H,
+    REG_I, REG_J, REG_K, REG_L,
+    REG_DBR, REG_PBR, REG_SP, REG_PC,
+};
 
-    // program counter
-    u16 pc;
+// Here's our machine!
+//
+// Everything an instruction touches on the way through is up front so
+// it all shares a couple of cache lines; RAM and the rest go at the end.
+typedef struct interp {
+    // all 16 registers, indexed by register id
+    u16 regs[16];
 
     // interpreter flags
     u16 flags;
 
+    // Carry and zero don't get worked out after every ALU instruction,
+    // since hardly anything looks at them. Instead we keep the last
+    // operation, its operands and its result here, and sync_flags puts
+    // them into flags when something wants them. LF_NONE means flags
+    // is already up to date.
+    u8 lf_op;
+    u8 lf_carry;
+    u16 lf_a;
+    u16 lf_b;
+    u16 lf_res;
+
+    // set when a store means the JIT should leave the block it's in
+    u8 jit_exit;
+
+    // how many stores we've done (so we can tell if a loop is idle)
+    u32 stores;
+
+    // master clock: CPU cycles since we started. Everything the program
+    // can see happen (lines, frames, interrupts) is timed off this.
+    u64 cycles;
+
+    // the cycle the current slice ends at; fused instruction pairs
+    // (see predecode_rom) only run as one if both halves start before
+    // it. 0 means never fuse.
+    u64 cycle_limit;
+
+    // which banks the maps are set up for right now
+    u16 code_bank;
+    u16 data_bank;
+
+    // The address space as seen by instruction fetches (banked areas
+    // follow pbr) and by loads and stores (banked areas follow dbr).
+    // See update_banks.
+    mem_page code_map[256];
+    mem_page data_map[256];
+
+    // Interrupt controller: which interrupts have happened but not
+    // been taken yet, and which ones the program wants ($ff04). See
+    // service_interrupts.
+    u8 irq_pending;
+    u8 irq_enabled;
+
+    // The key the program's looking at ($ff02), and the ones waiting
+    // behind it (the oldest is key_fifo[key_head]). A key press goes
+    // straight to last_key if the program's already read the one
+    // there (or has the keyboard interrupt masked), and in the FIFO
+    // otherwise; see handle_keydown.
+    u8 last_key;
+    // set while last_key hasn't been read through $ff02 yet
+    u8 key_unread;
+    // set if last_key went straight in and its keyboard interrupt
+    // hasn't been taken yet (so taking it mustn't move the FIFO on)
+    u8 key_irq_owed;
+    u8 key_fifo[KEY_FIFO_SIZE];
+    u8 key_head;
+    u8 key_count;
+    // set if a key got dropped because the FIFO was full (cleared by
+    // reading $ff03)
+    u8 key_overflow;
+
+    // Timer ($ff06 - $ff0a). Counts down from timer_reload, and
+    // interrupts when it gets to 0. While it's running, nothing
+    // counts: timer_due is the cycle it'll get to 0 on (and an
+    // EV_TIMER event), and the count is worked out from that when the
+    // program reads it. timer_count is the count while it's stopped.
+    u16 timer_reload;
+    u16 timer_count;
+    u8 timer_ctrl;
+    u64 timer_due;
+    // how many times the count's been read (see run_slice)
+    u32 timer_reads;
+
+    // DMA ($ff10 - $ff19): copy dma_len bytes from dma_src (with
+    // dma_bank at $4000 and $a000) to dma_offset in dma_dest, or fill
+    // them with dma_fill. See start_dma.
+    u16 dma_src;
+    u8 dma_bank;
+    u8 dma_dest;
+    u16 dma_offset;
+    u16 dma_len;
+    u8 dma_fill;
+    u8 dma_ctrl;
+
+    struct ppu *ppu;
+
     // pointer to ROM data
     u8 *rom;
 
     // 16k of sweet sweet RAM
-    u8 mem[16384];
-
-    // Last keyboard button pressed
-    u8 last_key;
-
-    struct ppu *ppu;
+    u8 mem[RAM_SIZE];
 } interp;
 
 // "PPU" stuff
@@ -135,12 +310,28 @@ typedef struct ppu {
     u8 fg_h_offset;
     u8 fg_v_offset;
     //
+    // HBLANK control (HBLANK_ENABLE, HBLANK_COMPARE) and the line
+    // compare register. Lines that don't get an interrupt cost nothing
+    // more than drawing them.
+    u8 hblank_ctrl;
+    u8 hblank_line;
+    //
     // palette data % 0rrrrrgg gggbbbbb
     //
     // (8 sprite palettes + 8 tile palettes)
     // x 8 colors each x 2 bytes/color = 256 bytes
     u8 palette_data[256];
     //
+    // palette_data again, already converted to the texture's pixel
+    // format (tile palettes first, then sprite palettes). Writes to
+    // $d400 - $d4ff just mark the color dirty and bump palette_gen;
+    // update_palette redoes the dirty ones the next time a line gets
+    // drawn with a palette_gen it hasn't seen.
+    u32 palette_colors[N_PALETTES * 2][N_COLORS];
+    u8 palette_dirty[N_PALETTES * 2 * N_COLORS];
+    u32 palette_gen;
+    u32 palette_seen;
+    //
     // 32 x 32 background tilemap
     // 2 bytes/tile
     //
@@ -157,6 +348,17 @@ typedef struct ppu {
     // same as above
     u8 fg_map_data[2048];
     //
+    // Both tilemaps drawn out in full ([0] is bg, [1] fg), as the
+    // palette index and priority of each of their 256 x 256 pixels.
+    // A write to a map entry marks its cell dirty, and a write to a
+    // tile's pattern bumps its tile_gen; tile_layer redraws a cell
+    // when it's dirty or was drawn with an older tile_gen. (Palette
+    // writes don't matter, since these are only indices.)
+    u8 layer_col[2][256][256];
+    u8 layer_pri[2][256][256];
+    u8 cell_dirty[2][32 * 32];
+    u32 cell_gen[2][32 * 32];
+    //
     // OAM - positions of sprites on screen
     //
     // 4 bytes per sprite:
@@ -169,6 +371,14 @@ typedef struct ppu {
     // 256 sprites on screen max. 256 x 4 = 1K
     u8 oam[1024];
     //
+    // Which sprites are on each line, in OAM order, so scanline doesn't
+    // have to look at all 256 every time. Rebuilt by bin_sprites when
+    // something that moves sprites between lines (the flags or y byte
+    // of an OAM entry, or sprite_v_offset) has changed.
+    u8 line_sprites[MAX_SCRH][256];
+    u16 line_sprite_count[MAX_SCRH];
+    u8 sprites_dirty;
+    //
     // sprite/tile data
     //
     // 4bpp, first bit is 'priority bit' for layering
@@ -182,16 +392,151 @@ typedef struct ppu {
     // x 8 pixels wide x 8 pixels tall = 16K
     u8 pattern_offset;
     u8 pattern_table[16384];
+    //
+    // pattern_table again, one byte per pixel (priority bit and color,
+    // same as the 4 bits they came from), for each of the 512 x 8 tile
+    // rows: [0] is the row as it is, [1] flipped horizontally. A write
+    // to the pattern table just marks the row dirty; pattern_row
+    // decodes it again next time it's drawn.
+    u8 pattern_rows[512 * SPRITE_HEIGHT][2][SPRITE_WIDTH];
+    u8 pattern_dirty[512 * SPRITE_HEIGHT];
+    // how many times each tile's pattern has been written to
+    u32 tile_gen[512];
+    //
+    // Set by any write that changes what would be on screen. A frame
+    // only gets drawn if there was one since the last frame started
+    // (or once there's been one partway through it); otherwise the
+    // framebuffer still has the right picture from last time.
+    // lines_drawn says whether this frame drew anything.
+    u8 screen_changed;
+    u8 redraw_frame;
+    u16 lines_drawn;
+    //
+    // Lines [pending_from, pending_to) have ended but haven't been
+    // drawn yet (see "Parallel lines").
+    u16 pending_from;
+    u16 pending_to;
 } ppu;
 
 void do_instr(interp *I);
 
+struct decoded;
+
+// Handles one kind of instruction; see do_instr.
+typedef void (*instr_handler)(interp *I, const struct decoded *d);
+
+// An instruction, picked apart ahead of time.
+typedef struct decoded {
+    instr_handler fn;
+    // the raw instruction word
+    u16 instr;
+    // operand: the word following the instruction, a constant from the
+    // instruction itself, or a relative jump offset (depending on fn)
+    u16 imm;
+    // register indices
+    u8 x;
+    u8 y;
+    // instruction length in bytes (2 or 4)
+    u8 len;
+    // how long it takes to run, in CPU cycles
+    u8 cycles;
+    // set if it can write dbr or pbr (so the memory map needs updating)
+    u8 sets_bank;
+} decoded;
+
+// template for every possible instruction word (imm not filled in
+// if it comes from the following word)
+decoded instr_table[65536];
+
+// the whole ROM, decoded. fn is NULL where we couldn't.
+decoded rom_code[ROM_SIZE / 2];
+
+void init_instr_table();
+void predecode_rom(u8 *rom);
+
+void init_memory(interp *I);
+void update_banks(interp *I);
+
+void sync_flags(interp *I);
+void print_state(interp *I);
+void print_regs(interp *I);
+void run_bench(interp *I, long count);
+void run_line_bench(interp *I, long count);
+void pick_compositor(int use_simd);
+void print_fusion(u64 n_instrs);
+extern u64 fused_pairs;
+extern u64 fused_splits;
+
+extern int use_jit;
+int init_jit();
+void jit_ram_written(interp *I, u16 offset);
+int cpu_step(interp *I, u64 limit);
+long run_slice(interp *I, u64 until);
+void service_interrupts(interp *I);
+void raise_irq(interp *I, u8 irq);
+u16 timer_count(interp *I);
+void timer_control(interp *I, u8 value);
+void start_dma(interp *I);
+
 int interrupt(interp *I, u16 addr);
 
 void init_ppu(ppu *p);
 
 int init_draw();
-void draw(interp *I);
+void present_frame();
+void end_line(interp *I, int line_num);
+
+// Kinds of timed event (see "Scheduler"), in the order they go in when
+// they're due at the same time.
+enum {
+    EV_POLL,    // look at the window
+    EV_LINE,    // a line's ended
+    EV_TIMER,   // the timer's got to 0
+    N_EVENTS
+};
+
+typedef struct event {
+    u64 when;
+    u8 kind;
+} event;
+
+void schedule(u8 kind, u64 when);
+void cancel_event(u8 kind);
+void start_timer(interp *I, u64 from);
+event next_event();
+void run_event(interp *I, event e);
+extern event event_queue[];
+static inline u64 next_event_time() {
+    return event_queue[0].when;
+}
+
+// ring entries for the render thread (see "Threaded rendering"):
+// addr << 8 | value for a write (addr is always $c000 or more), or
+#define RING_LINE   0x00000     // | line number that ended
+#define RING_FRAME  0x10000     // frame's done, say when it's drawn
+#define RING_REDRAW 0x20000     // draw the next frame regardless
+#define RING_QUIT   0x30000
+// DMA: RING_DMA | destination, then offset << 16 | length, then the
+// bytes, four to an entry (high byte first). RING_FILL | destination
+// << 8 | fill value instead, then offset << 16 | length.
+#define RING_DMA    0x40000
+#define RING_FILL   0x50000
+// most bytes one RING_DMA entry carries (see dma_run)
+#define DMA_RING_CHUNK 4096
+void ring_push(u32 entry);
+void ring_publish();
+
+#define MAX_RENDER_WORKERS 16
+extern int render_workers;
+void start_render_workers(int n);
+void stop_render_workers();
+void flush_lines(ppu *p);
+void ring_mark(u32 marker);
+int start_render_thread(ppu *p);
+void stop_render_thread();
+extern SDL_sem *frame_done;
+extern ppu *render_ppu;
+void pace_frame();
 
 void handle_keydown(interp *I, SDL_KeyboardEvent key);
 
@@ -203,32 +548,9 @@ void insert_string(u8 *mem, u16 offset, int length, char *str) {
     }
 }
 
-u16 *get_reg(interp *I, char reg_id) {
-    // given register id (0-7), return a pointer to the right register
-    switch(reg_id) {
-        case 0:  return &I->a;   break;
-        case 1:  return &I->b;   break;
-        case 2:  return &I->c;   break;
-        case 3:  return &I->d;   break;
-        case 4:  return &I->e;   break;
-        case 5:  return &I->f;   break;
-        case 6:  return &I->g;   break;
-        case 7:  return &I->h;   break;
-        case 8:  return &I->i;   break;
-        case 9:  return &I->j;   break;
-        case 10: return &I->k;   break;
-        case 11: return &I->l;   break;
-        case 12: return &I->dbr; break;
-        case 13: return &I->pbr; break;
-        case 14: return &I->sp;  break;
-        case 15: return &I->pc;  break;
-        default:
-            fprintf(stderr, "internal error: invalid reg id %d\n", reg_id);
-#ifdef DEBUG
-            debug_counter = 0;
-#endif
-            return 0;
-    }
+static inline u16 *get_reg(interp *I, u8 reg_id) {
+    // given register id (0-15), return a pointer to the right register
+    return &I->regs[reg_id];
 }
 
 // Uh, it's apparently implementation-defined for C as to
@@ -248,333 +570,895 @@ u16 srl(u16 val, int amt) {
     return val;
 }
 
-void store_byte(interp *I, u16 addr, u8 value) {
-    // we have 16k of ram, always mapped to 0x0000~0x4000 no matter what bank
-    if (addr < 0x4000) {
-        I->mem[addr] = value;
-    }
+/*
+ * Memory
+ *
+ * Everything goes through a 256-entry page table (one for instruction
+ * fetches, one for data; they only differ in which bank shows up at
+ * $4000 and $A000). See memory_map for what lives where.
+ */
 
-    // a 32k chunk of ROM always mapped to upper half of bank, but not writable!
-    if (addr > 0x8000) {
-        fprintf(stderr, "Attempt to write to ROM-mapped location $%02X:%04X "
-                "(pc: $%02X:%04X)\n", I->dbr, addr, I->pbr, I->pc);
+u8 unmapped_read(interp *I, u16 addr) {
+    printf("Unimplemented reading from %04X\n", addr);
 #ifdef DEBUG
-        debug_counter = 0;
+    debug_counter = 0;
+#endif
+    return 0;
+}
+
+void unmapped_write(interp *I, u16 addr, u8 value) {
+    printf("Unimplemented writing to %04X\n", addr);
+#ifdef DEBUG
+    debug_counter = 0;
+#endif
+}
+
+void rom_write(interp *I, u16 addr, u8 value) {
+    fprintf(stderr, "Attempt to write to ROM-mapped location $%02X:%04X "
+            "(pc: $%02X:%04X)\n", I->regs[REG_DBR], addr,
+            I->regs[REG_PBR], I->regs[REG_PC]);
+#ifdef DEBUG
+    debug_counter = 0;
 #endif
+}
+
+// Where a byte of the $D500 - $D5FF pattern table windows really is.
+u8 *pattern_window(ppu *p, u16 addr) {
+    // $d500 - $d57f is 128 bytes of the low half of the
+    // pattern table at offset [$d7f9] * 32
+    // $d580 - $d5ff is the same for the high half
+    // (each window wraps around inside its own half)
+    u16 half = (addr & 0x80) ? 8192 : 0;
+    return &p->pattern_table[half + (p->pattern_offset * 32 + (addr & 0x7f)) % 8192];
+}
+
+// The PPU's registers, for the ones that are just a byte.
+u8 *ppu_reg(ppu *p, u16 addr) {
+    switch (addr) {
+        // $d7f9 is the pattern table offset value
+        case 0xd7f9: return &p->pattern_offset;
+        // $d7fa/$d7fb are the BG layer's horizontal/vertical offset (signed)
+        case 0xd7fa: return &p->bg_h_offset;
+        case 0xd7fb: return &p->bg_v_offset;
+        // $d7fc/$d7fd are the FG layer's
+        case 0xd7fc: return &p->fg_h_offset;
+        case 0xd7fd: return &p->fg_v_offset;
+        // $d7fe/$d7ff are the sprite layer's
+        case 0xd7fe: return &p->sprite_h_offset;
+        case 0xd7ff: return &p->sprite_v_offset;
+        // $d7f7 is the line compare register, $d7f8 HBLANK control
+        case 0xd7f7: return &p->hblank_line;
+        case 0xd7f8: return &p->hblank_ctrl;
+        // $d600 - $d7f6 is currently unused, but reserved
+        default: return NULL;
+    }
+}
+
+u8 ppu_read(interp *I, u16 addr) {
+    if (addr < 0xd600) {
+        return *pattern_window(I->ppu, addr);
+    }
+    u8 *reg = ppu_reg(I->ppu, addr);
+    if (!reg) {
+        return unmapped_read(I, addr);
+    }
+    return *reg;
+}
+
+// The PPU side of writes to video memory. These only touch the ppu,
+// so the render thread (see "Threaded rendering") can replay them on
+// its own copy.
+
+void pattern_store(ppu *p, u16 addr, u8 value) {
+    u8 *at = pattern_window(p, addr);
+    if (*at != value) {
+        p->screen_changed = 1;
     }
+    *at = value;
+    // (SPRITE_BYTES / SPRITE_HEIGHT bytes per tile row)
+    int row = (at - p->pattern_table) / (SPRITE_BYTES / SPRITE_HEIGHT);
+    p->pattern_dirty[row] = 1;
+    p->tile_gen[row / SPRITE_HEIGHT]++;
+}
 
-    /* TODO come up with the rest of the memory mapping!!
-     * t o o   t i r e d   for this right now */
+void reg_store(ppu *p, u16 addr, u8 value) {
+    u8 *reg = ppu_reg(p, addr);
+    // (only the offsets show; the pattern table offset just moves the
+    // windows around)
+    if (addr >= 0xd7fa && *reg != value) {
+        p->screen_changed = 1;
+    }
+    if (addr == 0xd7ff && *reg != value) {
+        p->sprites_dirty = 1;
+    }
+    *reg = value;
+}
 
-    /*
-    // 0x8000-0x9fff is always the first 8k of RAM
-    else if (addr < 0xa000) {
-        I->mem[addr - 0x8000] = value;
+void tilemap_store(ppu *p, u16 addr, u8 value) {
+    // $c000 - $c7ff is the bg map, $c800 - $cfff the fg one
+    int layer = (addr & 0x800) ? 1 : 0;
+    u8 *at = (layer ? p->fg_map_data : p->bg_map_data) + (addr & 0x7ff);
+    if (*at != value) {
+        // two bytes per cell
+        p->cell_dirty[layer][(addr & 0x7ff) >> 1] = 1;
+        p->screen_changed = 1;
     }
+    *at = value;
+}
 
-    // writing to 0xa000-0xbfff writes to the current banked chunk of RAM
-    // (there are 8 of these, although #0 is always also mapped to
-    // 0x8000-0x9fff)
-    else if (addr < 0xc000) {
-        I->mem[addr - 0xa000 + I->ram_bank * 0x2000] = value;
+void oam_store(ppu *p, u16 addr, u8 value) {
+    u8 *at = &p->oam[addr & 0x3ff];
+    if (*at != value) {
+        p->screen_changed = 1;
+    }
+    // only the flags and y decide which lines a sprite is on
+    if ((addr & 3) != 1 && (addr & 3) != 2 && *at != value) {
+        p->sprites_dirty = 1;
     }
+    *at = value;
+}
 
-    // $c000 - $cfff is reserved for video-related stuff (tho not all
-    // of it is used atm.)
+void palette_store(ppu *p, u16 addr, u8 value) {
+    if (p->palette_data[addr & 0xff] != value) {
+        p->screen_changed = 1;
+    }
+    p->palette_data[addr & 0xff] = value;
+    // two bytes per color
+    p->palette_dirty[(addr & 0xff) >> 1] = 1;
+    p->palette_gen++;
+}
 
-    // $c000 - $c7ff is background tilemap
-    else if (addr < 0xc800) {
-        I->ppu->bg_map_data[addr - 0xc000] = value;
+void ppu_store(ppu *p, u16 addr, u8 value) {
+    // (addr is somewhere in $c000 - $d7ff that's really there)
+    if (p->pending_to) {
+        // lines that ended before this have to be drawn without it
+        flush_lines(p);
     }
-    // $c800 - $cfff is foreground tilemap
-    else if (addr < 0xd000) {
-        I->ppu->fg_map_data[addr - 0xc800] = value;
+    if (addr < 0xd000) {
+        tilemap_store(p, addr, value);
+    } else if (addr < 0xd400) {
+        oam_store(p, addr, value);
+    } else if (addr < 0xd500) {
+        palette_store(p, addr, value);
+    } else if (addr < 0xd600) {
+        pattern_store(p, addr, value);
+    } else {
+        reg_store(p, addr, value);
     }
-    // $d000 - $d3ff is OAM
-    else if (addr < 0xd400) {
-        I->ppu->oam[addr - 0xd000] = value;
+}
+
+// Where DMA destination dest is in the ppu, and how big it is (NULL if
+// there's no such thing).
+u8 *dma_region(ppu *p, u8 dest, u32 *size) {
+    switch (dest) {
+        case DMA_PATTERN: *size = sizeof(p->pattern_table); return p->pattern_table;
+        case DMA_BG_MAP: *size = sizeof(p->bg_map_data); return p->bg_map_data;
+        case DMA_FG_MAP: *size = sizeof(p->fg_map_data); return p->fg_map_data;
+        case DMA_OAM: *size = sizeof(p->oam); return p->oam;
+        case DMA_PALETTE: *size = sizeof(p->palette_data); return p->palette_data;
+        default: return NULL;
     }
-    // $d400 - $d4ff is palette data
-    else if (addr < 0xd500) {
-        I->ppu->palette_data[addr - 0xd400] = value;
+}
+
+void ppu_dma(ppu *p, u8 dest, u16 offset, const u8 *src, u8 fill, u32 len) {
+    // The PPU side of a DMA transfer: len bytes from src (or len
+    // copies of fill, if src is NULL) to offset in dest, wrapping
+    // around inside it. Marks the same things dirty the byte at a time
+    // stores would, but a run at a time.
+    u32 size;
+    u8 *base = dma_region(p, dest, &size);
+    if (!base) {
+        return;
     }
-    // $d500 - $d57f is 128 bytes of the low half of the
-    // pattern table at offset [$cffb] * 32
-    else if (addr < 0xd57f) {
-        I->ppu->pattern_table[I->ppu->pattern_offset * 32 + addr - 0xd500] = value;
-    }
-    // $d580 - $d5ff is 128 bytes of the high half of the
-    // pattern table at offset [$cffb] * 32
-    else if (addr < 0xd600) {
-        I->ppu->pattern_table[(I->ppu->pattern_offset * 32
-                                + addr - 0xd580 + 8192) % 0x10000] = value;
-    }
-    // 505 bytes at $d600 - $d7f8 is currently unused, but reserved
-    else if (addr < 0xcff9) {
-        // nothing happens
-        printf("Unimplemented writing to %04X\n", addr);
-#ifdef DEBUG
-        debug_counter = 0;
-#endif
+    if (p->pending_to) {
+        flush_lines(p);
     }
-    // $d7f9 is the pattern table offset value
-    else if (addr == 0xd7f9) {
-        I->ppu->pattern_offset = value;
+
+    while (len) {
+        u32 at = offset % size;
+        u32 n = len < size - at ? len : size - at;
+        u8 *to = base + at;
+
+        int changed = 0;
+        if (src) {
+            changed = memcmp(to, src, n) != 0;
+            memcpy(to, src, n);
+            src += n;
+        } else {
+            for (u32 i = 0; i < n && !changed; i++) {
+                changed = to[i] != fill;
+            }
+            memset(to, fill, n);
+        }
+
+        if (changed) {
+            p->screen_changed = 1;
+        }
+        u32 last = at + n - 1;
+        switch (dest) {
+            case DMA_PATTERN:
+                // (pattern_store doesn't care if it changed either)
+                for (u32 r = at / (SPRITE_BYTES / SPRITE_HEIGHT);
+                        r <= last / (SPRITE_BYTES / SPRITE_HEIGHT); r++) {
+                    p->pattern_dirty[r] = 1;
+                }
+                for (u32 t = at / SPRITE_BYTES; t <= last / SPRITE_BYTES; t++) {
+                    p->tile_gen[t]++;
+                }
+                break;
+            case DMA_BG_MAP:
+            case DMA_FG_MAP:
+                if (changed) {
+                    memset(&p->cell_dirty[dest == DMA_FG_MAP][at / 2], 1,
+                           last / 2 - at / 2 + 1);
+                }
+                break;
+            case DMA_OAM:
+                if (changed) {
+                    p->sprites_dirty = 1;
+                }
+                break;
+            case DMA_PALETTE:
+                memset(&p->palette_dirty[at / 2], 1, last / 2 - at / 2 + 1);
+                p->palette_gen++;
+                break;
+        }
+
+        len -= n;
+        offset = 0;
     }
-    // $d7fa is the BG layer's horizontal offset (signed)
-    else if (addr == 0xd7fa) {
-        I->ppu->bg_h_offset = value;
+}
+
+void ppu_write(interp *I, u16 addr, u8 value) {
+    // Every write to $c000 - $d7ff comes through here.
+    if (addr >= 0xd600 && !ppu_reg(I->ppu, addr)) {
+        unmapped_write(I, addr, value);
+        return;
     }
-    // $d7fb is the BG layer's vertical offset (signed)
-    else if (addr == 0xd7fb) {
-        I->ppu->bg_v_offset = value;
+    ppu_store(I->ppu, addr, value);
+    if (threaded_ppu) {
+        ring_push(addr << 8 | value);
     }
-    // $d7fc is the FG layer's horizontal offset (signed)
-    else if (addr == 0xd7fc) {
-        I->ppu->fg_h_offset = value;
+}
+
+void next_key(interp *I) {
+    // Move the oldest waiting key into $ff02.
+    if (I->key_count) {
+        I->last_key = I->key_fifo[I->key_head];
+        I->key_head = (I->key_head + 1) % KEY_FIFO_SIZE;
+        I->key_count--;
+        I->key_unread = 1;
     }
-    // $d7fd is the FG layer's vertical offset (signed)
-    else if (addr == 0xd7fd) {
-        I->ppu->fg_v_offset = value;
+    I->key_irq_owed = 0;
+    if (!I->key_count) {
+        I->irq_pending &= ~IRQ_KEY;
     }
-    // $d7fe is the sprite layer's horizontal offset (signed)
-    else if (addr == 0xd7fe) {
-        I->ppu->sprite_h_offset = value;
+}
+
+u8 read_key(interp *I) {
+    // $ff02. A program that polls (the keyboard interrupt masked, or
+    // interrupts off) and has already seen last_key gets the next
+    // waiting one, so keys that queued up between polls still come
+    // through in order.
+    int polling = !(I->irq_enabled & IRQ_KEY) || !(I->flags & INTERRUPT_ENABLE);
+    if (polling && !I->key_unread && I->key_count) {
+        next_key(I);
     }
-    // $d7ff is the sprite layer's vertical offset (signed)
-    else if (addr == 0xd7ff) {
-        I->ppu->sprite_v_offset = value;
-    } else if (addr == 0xff02) {
-        // doesn't do anything
-        printf("Attempted write to read-only HW register $FF02 (keyboard key)\n");
-#ifdef DEBUG
-        debug_counter = 0;
-#endif
+    I->key_unread = 0;
+    if (I->key_irq_owed) {
+        // it's been seen, so no interrupt for it later
+        I->key_irq_owed = 0;
+        if (!I->key_count) {
+            I->irq_pending &= ~IRQ_KEY;
+        }
     }
+    return I->last_key;
+}
 
+u8 hw_read(interp *I, u16 addr) {
+    switch (addr) {
+        // $ff00 is the program (ROM) bank, $ff01 the data (RAM) bank
+        case 0xff00: return I->regs[REG_PBR];
+        case 0xff01: return I->regs[REG_DBR];
+        // $ff02 is the newest key the program hasn't seen (see
+        // handle_keydown and read_key)
+        case 0xff02: return read_key(I);
+        // $ff03 is keyboard status: how many more keys are waiting,
+        // with bit 7 set if one got dropped since the last read
+        case 0xff03: {
+            u8 status = I->key_count | (I->key_overflow ? 0x80 : 0);
+            I->key_overflow = 0;
+            return status;
+        }
+        // $ff04 is which interrupts are enabled, $ff05 which ones are
+        // pending (IRQ_*)
+        case 0xff04: return I->irq_enabled;
+        case 0xff05: return I->irq_pending;
+        // $ff06/$ff07 is the timer reload value, $ff08/$ff09 the count
+        // (high byte first, like words), $ff0a timer control
+        case 0xff06: return I->timer_reload >> 8;
+        case 0xff07: return I->timer_reload & 0xff;
+        case 0xff08: I->timer_reads++; return timer_count(I) >> 8;
+        case 0xff09: I->timer_reads++; return timer_count(I) & 0xff;
+        case 0xff0a: return I->timer_ctrl;
+        // $ff10 - $ff19 is DMA (see start_dma)
+        case 0xff10: return I->dma_src >> 8;
+        case 0xff11: return I->dma_src & 0xff;
+        case 0xff12: return I->dma_bank;
+        case 0xff13: return I->dma_dest;
+        case 0xff14: return I->dma_offset >> 8;
+        case 0xff15: return I->dma_offset & 0xff;
+        case 0xff16: return I->dma_len >> 8;
+        case 0xff17: return I->dma_len & 0xff;
+        case 0xff18: return I->dma_fill;
+        case 0xff19: return I->dma_ctrl;
+        default: return unmapped_read(I, addr);
+    }
+}
 
-    else {
-        printf("Unimplemented writing to %04X\n", addr);
+void hw_write(interp *I, u16 addr, u8 value) {
+    switch (addr) {
+        case 0xff00:
+            I->regs[REG_PBR] = value;
+            update_banks(I);
+            break;
+        case 0xff01:
+            I->regs[REG_DBR] = value;
+            update_banks(I);
+            break;
+        case 0xff02:
+            // doesn't do anything
+            printf("Attempted write to read-only HW register $FF02 (keyboard key)\n");
 #ifdef DEBUG
-        debug_counter = 0;
+            debug_counter = 0;
+#endif
+            break;
+        case 0xff03:
+            // any write takes the next key, for reading keys without
+            // the interrupt
+            next_key(I);
+            break;
+        case 0xff04:
+            I->irq_enabled = value & IRQ_ALL;
+            break;
+        case 0xff05:
+            // writing 1s drops those pending interrupts (except a key
+            // one, which stays pending while there are keys waiting)
+            I->irq_pending &= ~value;
+            if (I->key_count || I->key_irq_owed) {
+                I->irq_pending |= IRQ_KEY;
+            }
+            break;
+        case 0xff06:
+            I->timer_reload = (I->timer_reload & 0x00ff) | (value << 8);
+            break;
+        case 0xff07:
+            I->timer_reload = (I->timer_reload & 0xff00) | value;
+            break;
+        case 0xff08:
+        case 0xff09:
+            printf("Attempted write to read-only HW register $%04X (timer count)\n", addr);
+#ifdef DEBUG
+            debug_counter = 0;
 #endif
+            break;
+        case 0xff0a:
+            timer_control(I, value);
+            break;
+        case 0xff10:
+            I->dma_src = (I->dma_src & 0x00ff) | (value << 8);
+            break;
+        case 0xff11:
+            I->dma_src = (I->dma_src & 0xff00) | value;
+            break;
+        case 0xff12:
+            I->dma_bank = value;
+            break;
+        case 0xff13:
+            I->dma_dest = value;
+            break;
+        case 0xff14:
+            I->dma_offset = (I->dma_offset & 0x00ff) | (value << 8);
+            break;
+        case 0xff15:
+            I->dma_offset = (I->dma_offset & 0xff00) | value;
+            break;
+        case 0xff16:
+            I->dma_len = (I->dma_len & 0x00ff) | (value << 8);
+            break;
+        case 0xff17:
+            I->dma_len = (I->dma_len & 0xff00) | value;
+            break;
+        case 0xff18:
+            I->dma_fill = value;
+            break;
+        case 0xff19:
+            I->dma_ctrl = value & (DMA_FILL | DMA_IRQ);
+            if (value & DMA_START) {
+                start_dma(I);
+            }
+            break;
+        default:
+            unmapped_write(I, addr, value);
     }
-    */
 }
 
-u8 load_byte(interp *I, u16 addr, int bank) {
-    // Reading below $4000 returns stuff in first 16k of ROM, always
+/*
+ * DMA
+ *
+ * Copies (or fills) a block of video memory in one go. The CPU stops
+ * for dma_cycles a byte while it happens, and the data's all there
+ * straight away.
+ */
+
+// Where the byte DMA would read at addr (in the given bank) is, and
+// how many more follow it in the same chunk of memory. NULL if it's
+// not ROM or RAM.
+const u8 *dma_source(interp *I, u8 bank, u16 addr, u32 *avail) {
     if (addr < 0x4000) {
-        return I->rom[addr];
+        *avail = 0x4000 - addr;
+        return I->rom + addr;
+    } else if (addr < 0x8000) {
+        // (same banks as map_banks)
+        if (0x4000 + (bank + 1) * 0x4000 > ROM_SIZE) {
+            return NULL;
+        }
+        *avail = 0x8000 - addr;
+        return I->rom + (bank + 1) * 0x4000 + (addr - 0x4000);
+    } else if (addr < 0xa000) {
+        *avail = 0xa000 - addr;
+        return I->mem + (addr - 0x8000);
+    } else if (addr < 0xc000) {
+        if ((bank + 1) * 0x2000 > RAM_SIZE) {
+            return NULL;
+        }
+        *avail = 0xc000 - addr;
+        return I->mem + bank * 0x2000 + (addr - 0xa000);
     }
+    return NULL;
+}
 
-    // Reading $4000 - $7fff returns stuff in a different 16k chunk of ROM
-    else if (addr < 0x8000) {
-        return I->rom[addr + bank * 0x4000];
+void dma_run(interp *I, const u8 *src, u32 len) {
+    // Send len bytes (or fills, if src is NULL) to where DMA's up to.
+    ppu_dma(I->ppu, I->dma_dest, I->dma_offset, src, I->dma_fill, len);
+
+    if (threaded_ppu) {
+        // A copy goes across DMA_RING_CHUNK bytes at a time, each
+        // piece handed over as soon as it's in. So the CPU thread is
+        // never more than a piece (and a line's writes) ahead of what
+        // the render thread can see, and ring_push can always wait
+        // for room.
+        for (u32 done = 0; src && done < len; done += DMA_RING_CHUNK) {
+            u32 n = len - done < DMA_RING_CHUNK ? len - done : DMA_RING_CHUNK;
+            ring_push(RING_DMA | I->dma_dest);
+            ring_push((u32)(u16)(I->dma_offset + done) << 16 | n);
+            for (u32 i = 0; i < n; i += 4) {
+                u32 entry = 0;
+                for (u32 j = 0; j < 4; j++) {
+                    entry = entry << 8 | (i + j < n ? src[done + i + j] : 0);
+                }
+                ring_push(entry);
+            }
+            ring_publish();
+        }
+        if (!src) {
+            ring_push(RING_FILL | I->dma_dest << 8 | I->dma_fill);
+            ring_push((u32)I->dma_offset << 16 | len);
+            ring_publish();
+        }
     }
 
-    // Reading $8000 - $9fff returns values in first 8k of RAM
-    else if (addr < 0xa000) {
-        return I->mem[addr - 0x8000];
-    }
+    I->dma_offset += len;
+}
 
-    // Reading $a000 - $bfff returns values in other 8k of RAM
-    else if (addr < 0xc000) {
-        return I->mem[addr - 0xa000 + bank * 0x2000];
+void start_dma(interp *I) {
+    // Do the transfer ($ff19 was written with DMA_START). The source
+    // address and destination offset end up just past what got
+    // copied, so the next transfer can carry on from there.
+    u32 size;
+    if (!dma_region(I->ppu, I->dma_dest, &size)) {
+        fprintf(stderr, "DMA to unknown destination %d (pc: $%04X)\n",
+                I->dma_dest, I->regs[REG_PC]);
+#ifdef DEBUG
+        debug_counter = 0;
+#endif
+        return;
     }
 
-    // $c000 - $c7ff is background tilemap
-    else if (addr < 0xc800) {
-        return I->ppu->bg_map_data[addr - 0xc000];
+    u32 left = I->dma_len;
+    if (I->dma_ctrl & DMA_FILL) {
+        dma_run(I, NULL, left);
+        left = 0;
     }
-    // $c800 - $cfff is foreground tilemap
-    else if (addr < 0xd000) {
-        return I->ppu->fg_map_data[addr - 0xc800];
+    while (left) {
+        u32 avail;
+        const u8 *src = dma_source(I, I->dma_bank, I->dma_src, &avail);
+        if (!src) {
+            fprintf(stderr, "DMA from unreadable location $%02X:%04X (pc: $%04X)\n",
+                    I->dma_bank, I->dma_src, I->regs[REG_PC]);
+#ifdef DEBUG
+            debug_counter = 0;
+#endif
+            break;
+        }
+        u32 n = left < avail ? left : avail;
+        dma_run(I, src, n);
+        I->dma_src += n;
+        left -= n;
     }
-    // $d000 - $c3ff is OAM
-    else if (addr < 0xd400) {
-        return I->ppu->oam[addr - 0xd000];
+
+    // the CPU waits for it (run_slice notices the clock's moved on)
+    I->cycles += (u64)(I->dma_len - left) * dma_cycles;
+    if (I->dma_ctrl & DMA_IRQ) {
+        raise_irq(I, IRQ_DMA);
     }
-    // $d400 - $d47f is palette data
-    else if (addr < 0xd500) {
-        return I->ppu->palette_data[addr - 0xd400];
+}
+
+// Point pages [first, first + n) at n*256 bytes of host memory.
+void map_memory(mem_page *map, int first, int n, u8 *mem, int writable) {
+    for (int i = 0; i < n; i++) {
+        map[first + i].read = mem + i * 256;
+        map[first + i].write = writable ? mem + i * 256 : NULL;
+        map[first + i].read_fn = unmapped_read;
+        map[first + i].write_fn = writable ? unmapped_write : rom_write;
     }
-    // $d500 - $d57f is 128 bytes of the low half of the
-    // pattern table at offset [$cffb] * 32
-    else if (addr < 0xd580) {
-        return I->ppu->pattern_table[I->ppu->pattern_offset * 32 + addr - 0xd500];
-    }
-    // $d580 - $d5ff is 128 bytes of the high half of the
-    // pattern table at offset [$cffb] * 32
-    else if (addr < 0xd5ff) {
-        return I->ppu->pattern_table[(I->ppu->pattern_offset * 32
-                                        + addr - 0xd580 + 8192) & 0x10000];
-    }
-    // $d600 - $d7f8 is currently unused, but reserved
-    else if (addr < 0xd7f9) {
-        /* nothing happens */
-        printf("Unimplemented reading from %04X\n", addr);
-#ifdef DEBUG
-        debug_counter = 0;
-#endif
-        return 0;
+}
+
+void map_hardware(mem_page *map, int first, int n,
+                  u8 (*read_fn)(interp *I, u16 addr),
+                  void (*write_fn)(interp *I, u16 addr, u8 value)) {
+    for (int i = 0; i < n; i++) {
+        map[first + i].read = NULL;
+        map[first + i].write = NULL;
+        map[first + i].read_fn = read_fn;
+        map[first + i].write_fn = write_fn;
     }
-    // $d7f9 is the pattern table offset value
-    else if (addr == 0xd7f9) {
-        return I->ppu->pattern_offset;
+}
+
+void map_hardware_writes(mem_page *map, int first, int n,
+                         void (*write_fn)(interp *I, u16 addr, u8 value)) {
+    // for memory that can be read directly, but where the hardware has
+    // to know about writes (map_memory it read-only first)
+    for (int i = 0; i < n; i++) {
+        map[first + i].write = NULL;
+        map[first + i].write_fn = write_fn;
     }
-    // $d7fa is the BG layer's horizontal offset (signed)
-    else if (addr == 0xd7fa) {
-        return I->ppu->bg_h_offset;
+}
+
+void map_banks(interp *I, mem_page *map, int bank) {
+    // $4000 - $7fff is a 16k chunk of ROM picked by the bank
+    // (bank 0 is the 16k right after the fixed one)
+    if (0x4000 + (bank + 1) * 0x4000 <= ROM_SIZE) {
+        map_memory(map, 0x40, 0x40, I->rom + (bank + 1) * 0x4000, 0);
+    } else {
+        map_hardware(map, 0x40, 0x40, unmapped_read, rom_write);
     }
-    // $d7fb is the BG layer's vertical offset (signed)
-    else if (addr == 0xd7fb) {
-        return I->ppu->bg_v_offset;
+
+    // $a000 - $bfff is an 8k chunk of RAM picked by the bank
+    // (bank 0 is the same 8k as $8000 - $9fff)
+    if ((bank + 1) * 0x2000 <= RAM_SIZE) {
+        map_memory(map, 0xa0, 0x20, I->mem + bank * 0x2000, 1);
+    } else {
+        map_hardware(map, 0xa0, 0x20, unmapped_read, unmapped_write);
     }
-    // $d7fc is the FG layer's horizontal offset (signed)
-    else if (addr == 0xd7fc) {
-        return I->ppu->fg_h_offset;
+}
+
+void update_banks(interp *I) {
+    // Called whenever pbr or dbr might have changed.
+    if (I->regs[REG_PBR] != I->code_bank) {
+        map_banks(I, I->code_map, I->regs[REG_PBR]);
+        I->code_bank = I->regs[REG_PBR];
     }
-    // $d7fd is the FG layer's vertical offset (signed)
-    else if (addr == 0xd7fd) {
-        return I->ppu->fg_v_offset;
+    if (I->regs[REG_DBR] != I->data_bank) {
+        map_banks(I, I->data_map, I->regs[REG_DBR]);
+        I->data_bank = I->regs[REG_DBR];
     }
-    // $d7fe is the sprite layer's horizontal offset (signed)
-    else if (addr == 0xd7fe) {
-        return I->ppu->sprite_h_offset;
+}
+
+void init_memory(interp *I) {
+    // needs I->rom and I->ppu set up first
+    mem_page *maps[2] = { I->code_map, I->data_map };
+    ppu *p = I->ppu;
+
+    for (int m = 0; m < 2; m++) {
+        mem_page *map = maps[m];
+        // anything we don't mention below isn't anything
+        map_hardware(map, 0x00, 0x100, unmapped_read, unmapped_write);
+
+        // $0000 - $3fff is the first 16k of ROM, always
+        map_memory(map, 0x00, 0x40, I->rom, 0);
+        // $8000 - $9fff is the first 8k of RAM, always
+        map_memory(map, 0x80, 0x20, I->mem, 1);
+        // $c000 - $c7ff is background tilemap
+        map_memory(map, 0xc0, 0x08, p->bg_map_data, 0);
+        // $c800 - $cfff is foreground tilemap
+        map_memory(map, 0xc8, 0x08, p->fg_map_data, 0);
+        // $d000 - $d3ff is OAM
+        map_memory(map, 0xd0, 0x04, p->oam, 0);
+        // $d400 - $d4ff is palette data
+        map_memory(map, 0xd4, 0x01, p->palette_data, 0);
+        // Reads from those come straight from memory, but writes go
+        // through ppu_write so the caches (and the render thread)
+        // hear about them.
+        map_hardware_writes(map, 0xc0, 0x15, ppu_write);
+        // $d500 - $d7ff is the pattern table windows and PPU registers
+        map_hardware(map, 0xd5, 0x03, ppu_read, ppu_write);
+        // $ff00 - $ffff is other hardware registers
+        map_hardware(map, 0xff, 0x01, hw_read, hw_write);
+
+        map_banks(I, map, m ? I->regs[REG_DBR] : I->regs[REG_PBR]);
     }
-    // $d7ff is the sprite layer's vertical offset (signed)
-    else if (addr == 0xd7ff) {
-        return I->ppu->sprite_v_offset;
+
+    I->code_bank = I->regs[REG_PBR];
+    I->data_bank = I->regs[REG_DBR];
+}
+
+// Let the JIT know about a store to addr (in page).
+static inline void stored(interp *I, u16 addr, const mem_page *page) {
+    I->stores++;
+    if (addr >= 0xc000) {
+        // video memory or hardware registers, which compiled code has
+        // to stop and let the main loop notice
+        I->jit_exit = 1;
+    } else if (addr >= 0x8000 && use_jit && page->write) {
+        jit_ram_written(I, page->write - I->mem + (addr & 0xff));
     }
+}
+
+void store_byte(interp *I, u16 addr, u8 value) {
+    mem_page *page = &I->data_map[addr >> 8];
 
-    else if (addr == 0xff02) {
-        return I->last_key;
+    if (page->write) {
+        page->write[addr & 0xff] = value;
+    } else {
+        page->write_fn(I, addr, value);
     }
 
-    else {
-        printf("Unimplemented reading from %04X\n", addr);
-#ifdef DEBUG
-        debug_counter = 0;
-#endif
-        return 0;
+    stored(I, addr, page);
+}
+
+u8 load_byte(interp *I, u16 addr, const mem_page *map) {
+    const mem_page *page = &map[addr >> 8];
+
+    if (page->read) {
+        return page->read[addr & 0xff];
     }
+    return page->read_fn(I, addr);
 }
 
 void store_word(interp *I, u16 addr, u16 value) {
     if (addr % 2 == 1) {
-        fprintf(stderr, "Unaligned word write to $%04X (pc: $%04X)\n", addr, I->pc);
+        fprintf(stderr, "Unaligned word write to $%04X (pc: $%04X)\n",
+                addr, I->regs[REG_PC]);
 #ifdef DEBUG
         debug_counter = 0;
 #endif
         return;
     }
 
-    u8 hival = srl(value, 8) & 0xff;
-    u8 loval = value & 0xff;
+    // An aligned word never straddles two pages, so for plain memory
+    // it's just two bytes (big-endian) into the page. Hardware still
+    // sees a byte at a time, high byte first.
+    mem_page *page = &I->data_map[addr >> 8];
 
-    store_byte(I, addr, hival);
-    store_byte(I, addr + 1, loval);
+    if (page->write) {
+        u8 *p = page->write + (addr & 0xff);
+        p[0] = value >> 8;
+        p[1] = value & 0xff;
+    } else {
+        page->write_fn(I, addr, value >> 8);
+        page->write_fn(I, addr + 1, value & 0xff);
+    }
+
+    // (one call covers both bytes: JIT blocks start on even addresses)
+    stored(I, addr, page);
 }
 
-u16 load_word(interp *I, u16 addr, int bank) {
+u16 load_word(interp *I, u16 addr, const mem_page *map) {
     if (addr % 2 == 1) {
-        fprintf(stderr, "Unaligned word read at $%04X (pc: $%04X)\n", addr, I->pc);
+        fprintf(stderr, "Unaligned word read at $%04X (pc: $%04X)\n",
+                addr, I->regs[REG_PC]);
 #ifdef DEBUG
         debug_counter = 0;
 #endif
         return 0;
     }
 
-    u8 hival = load_byte(I, addr, bank);
-    u8 loval = load_byte(I, addr+1, bank);
+    const mem_page *page = &map[addr >> 8];
+
+    if (page->read) {
+        const u8 *p = page->read + (addr & 0xff);
+        return ((u16)p[0] << 8) | p[1];
+    }
+
+    u8 hival = page->read_fn(I, addr);
+    u8 loval = page->read_fn(I, addr + 1);
 
     return ((u16)hival << 8) | loval;
 }
 
 int main (int argc, char **argv) {
-    if (argc != 2) {
+    char *rom_path = NULL;
+
+    // --bench <n>: run n instructions with no video, then say how
+    // fast that was. (for profiling the interpreter)
+    long bench_instrs = 0;
+    // --bench-lines <n>: same idea for drawing n scanlines
+    long bench_lines = 0;
+    // --no-simd: composite lines the plain C way
+    int use_simd = 1;
+    // --threaded-ppu: draw on a second thread
+    int want_threaded_ppu = 0;
+    // --render-workers <n>: draw untouched runs of lines on n threads
+    int want_workers = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--bench") && i + 1 < argc) {
+            bench_instrs = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--bench-lines") && i + 1 < argc) {
+            bench_lines = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "--no-simd")) {
+            use_simd = 0;
+        } else if (!strcmp(argv[i], "--threaded-ppu")) {
+            want_threaded_ppu = 1;
+        } else if (!strcmp(argv[i], "--render-workers") && i + 1 < argc) {
+            want_workers = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--dma-cycles") && i + 1 < argc) {
+            dma_cycles = atoi(argv[++i]);
+            if (dma_cycles < 0) dma_cycles = 0;
+        } else if (!strcmp(argv[i], "--jit")) {
+            // compile hot code to native code
+            use_jit = 1;
+        } else if (!strcmp(argv[i], "--no-idle-skip")) {
+            idle_skip = 0;
+        } else if (!strcmp(argv[i], "--slice") && i + 1 < argc) {
+            slice_size = atol(argv[++i]);
+            if (slice_size < 1) slice_size = 1;
+        } else {
+            rom_path = argv[i];
+        }
+    }
+
+    if (!rom_path) {
         printf("Please supply a file name.\n");
         return 0;
     }
 
-    if (!init_draw()) {
+    if (widescreen) {
+        SCRW = 240;
+        SCRH = 144;
+    } else {
+        SCRW = 240;
+        SCRH = 176;
+    }
+
+    if (!bench_instrs && !bench_lines && !init_draw()) {
         fprintf(stderr, "Unable to initialize video.\n");
         return -1;
     }
 
+    pick_compositor(use_simd);
+
+    init_instr_table();
+
+#ifdef DEBUG
+    // the debugger wants to go one instruction at a time
+    use_jit = 0;
+    slice_size = 1;
+#endif
+    if (use_jit && !init_jit()) {
+        use_jit = 0;
+    }
+
     interp I;
     ppu P;
     init_ppu(&P);
 
     I.ppu = &P;
     I.flags = RUN_FLAG | INTERRUPT_ENABLE;
+    I.lf_op = LF_NONE;
+
+    I.irq_pending = 0;
+    I.irq_enabled = IRQ_ALL;
+    I.last_key = 0;
+    I.key_unread = 0;
+    I.key_irq_owed = 0;
+    I.key_head = 0;
+    I.key_count = 0;
+    I.key_overflow = 0;
+
+    I.timer_reload = 0;
+    I.timer_count = 0;
+    I.timer_ctrl = 0;
+    I.timer_due = 0;
+    I.timer_reads = 0;
+
+    I.dma_src = 0;
+    I.dma_bank = 0;
+    I.dma_dest = DMA_PATTERN;
+    I.dma_offset = 0;
+    I.dma_len = 0;
+    I.dma_fill = 0;
+    I.dma_ctrl = 0;
 
     // program starts at 0x0100, after a 256-byte header
-    I.pbr = 0;
-    I.dbr = 0;
+    I.regs[REG_PBR] = 0;
+    I.regs[REG_DBR] = 0;
 
-    I.pc = 0x0100;
+    I.regs[REG_PC] = 0x0100;
+
+    I.cycles = 0;
+    I.jit_exit = 0;
 
     // stack starts here... probably should fix this
-    I.sp = 0x9ffe;
+    I.regs[REG_SP] = 0x9ffe;
 
     // all other registers start at 0
-    I.a = I.b = I.c = I.d = I.e = I.f
-        = I.g = I.h = I.i = I.j = I.k = I.l = 0;
+    memset(&I.regs[REG_A], 0, (REG_L + 1) * sizeof(u16));
+
+    FILE *rom = fopen(rom_path, "rb");
 
-    FILE *rom = fopen(argv[1], "rb");
+    if (!rom) {
+        fprintf(stderr, "Couldn't open %s.\n", rom_path);
+        return -1;
+    }
 
     size_t size = fread(rom_buffer, 1, ROM_SIZE, rom);
 
     printf("Read %lu bytes from ROM.\n", size);
 
     I.rom = rom_buffer;
+    init_memory(&I);
+    predecode_rom(rom_buffer);
 
     strncpy(rom_title, (char*)&rom_buffer[2], 30);
     rom_title[30] = '\0';
     printf("Loaded: %s\n", rom_title);
 
-    unsigned int time = SDL_GetTicks();
+    if (bench_instrs) {
+        run_bench(&I, bench_instrs);
+        print_state(&I);
+        return 0;
+    }
+
+    if (want_workers > 1) {
+        start_render_workers(want_workers);
+    }
+
+    if (bench_lines) {
+        run_line_bench(&I, bench_lines);
+        return 0;
+    }
+
+    if (want_threaded_ppu) {
+        threaded_ppu = start_render_thread(&P);
+    }
+
+    // the first look at the window is straight away, and the first
+    // line ends a line from now
+    schedule(EV_POLL, 0);
+    schedule(EV_LINE, CYCLES_PER_LINE);
+    // instructions run (fused pairs count as one)
+    u64 n_instrs = 0;
 
-    draw(&I);
     while (I.flags & RUN_FLAG) {
-        SDL_Event event;
-        while (SDL_PollEvent(&event)) {
-            // quit when we close the window
-            // otherwise infinite loops become terrible
-            if (event.type == SDL_QUIT) {
-                I.flags &= ~RUN_FLAG;
-            } else if (event.type == SDL_KEYDOWN) {
-                // Later we'll have a 'controller mode' as well.
-                // For now, we just have a keyboard.
-                handle_keydown(&I, event.key);
-            }
-        }
-#ifdef DEBUG
-        if (SDL_GetTicks() - time >= (debug_counter ? 17 : 2000)) {
-#else
-        if (SDL_GetTicks() - time >= 17) {
-#endif
-            draw(&I);
-            time = SDL_GetTicks();
-            // vblank interrupt
-            interrupt(&I, VBLANK_INTERRUPT);
+        while (next_event_time() <= I.cycles) {
+            run_event(&I, next_event());
         }
         if (I.flags & INTERRUPT_ENABLE_NEXT) {
             I.flags &= ~INTERRUPT_ENABLE_NEXT;
             I.flags |= INTERRUPT_ENABLE;
         }
-        if (backup_key != 0xff) {
-            // Try again with the key code
-            I.last_key = backup_key;
-            if (interrupt(&I, KEYBOARD_INTERRUPT)) {
-                backup_key = 0xff;
-            }
+        if (I.irq_pending & I.irq_enabled) {
+            service_interrupts(&I);
         }
-        if (!(I.flags & WAIT_FLAG)) {
-            do_instr(&I);
+        if (I.flags & WAIT_FLAG) {
+            // halted: nothing happens until the next event
+            I.cycles = next_event_time();
+        } else {
+            n_instrs += run_slice(&I, next_event_time());
 #ifdef DEBUG
+            // (slice_size is 1 here, so this is still one instruction)
             if (debug_counter > 0) debug_counter --;
             instr_counter ++;
             if (debug_counter == 0) {
@@ -594,10 +1478,7 @@ int main (int argc, char **argv) {
                         cont = 1;
                     } else if (!strcmp(cmd, "state\n") || !strcmp(cmd, "s\n")) {
                         printf("==== STATE ====\n");
-                        printf("Reg: a: %04X b: %04X c: %04X d: %04X\n", I.a, I.b, I.c, I.d);
-                        printf("     e: %04X f: %04X g: %04X h: %04X\n", I.e, I.f, I.g, I.h);
-                        printf("     i: %04X j: %04X k: %04X l: %04X\n", I.i, I.j, I.k, I.l);
-                        printf("     DB %04X PB %04X SP %04X PC %04X\n", I.dbr, I.pbr, I.sp, I.pc);
+                        print_regs(&I);
                     } else if (!strcmp(cmd, "help\n")) {
                         printf("* Press enter or type \"cont\" to advance one instruction.\n");
                         printf("* Type \"state\" or \"s\" to print register state.\n");
@@ -617,11 +1498,17 @@ int main (int argc, char **argv) {
         }
     }
 
-    printf("==== FINAL STATE ====\n");
-    printf("Reg: a: %04X b: %04X c: %04X d: %04X\n", I.a, I.b, I.c, I.d);
-    printf("     e: %04X f: %04X g: %04X h: %04X\n", I.e, I.f, I.g, I.h);
-    printf("     i: %04X j: %04X k: %04X l: %04X\n", I.i, I.j, I.k, I.l);
-    printf("     DB %04X PB %04X SP %04X PC %04X\n", I.dbr, I.pbr, I.sp, I.pc);
+    if (threaded_ppu) {
+        stop_render_thread();
+    }
+    if (render_workers) {
+        stop_render_workers();
+    }
+
+    print_state(&I);
+    print_fusion(n_instrs + fused_pairs);
+    printf("Skipped %" PRIu64 " of %" PRIu64 " frames (nothing changed)\n",
+            frames_skipped, pace_frames);
 
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -629,302 +1516,867 @@ int main (int argc, char **argv) {
     return 0;
 }
 
-void do_instr(interp *I) {
-    u16 instr = load_word(I, I->pc, I->pbr);
+void print_state(interp *I) {
+    sync_flags(I);
+    printf("==== FINAL STATE ====\n");
+    print_regs(I);
+}
 
-    // first 4 bits are the opcode
-    u16 instrtype = srl(instr, 12) & 0xf;
+void print_regs(interp *I) {
+    u16 *r = I->regs;
+    printf("Reg: a: %04X b: %04X c: %04X d: %04X\n", r[REG_A], r[REG_B], r[REG_C], r[REG_D]);
+    printf("     e: %04X f: %04X g: %04X h: %04X\n", r[REG_E], r[REG_F], r[REG_G], r[REG_H]);
+    printf("     i: %04X j: %04X k: %04X l: %04X\n", r[REG_I], r[REG_J], r[REG_K], r[REG_L]);
+    printf("     DB %04X PB %04X SP %04X PC %04X\n", r[REG_DBR], r[REG_PBR], r[REG_SP], r[REG_PC]);
+}
 
-#ifdef DEBUG
-    printf("Instruction @ 0x%04X: 0x%04X\n", I->pc, instr);
-#endif
+void print_fusion(u64 n_instrs) {
+    u64 tries = fused_pairs + fused_splits;
+    printf("Fused %" PRIu64 " compare/branch pairs (%.1f%% of instructions,"
+            " %.1f%% of tries)\n", fused_pairs,
+            n_instrs ? 200.0 * fused_pairs / n_instrs : 0.0,
+            tries ? 100.0 * fused_pairs / tries : 0.0);
+}
 
-    int ok = 0;
+void run_bench(interp *I, long count) {
+    // Just the CPU: no video, no interrupts, no events.
+    // Stops early if the program halts or stops.
+    u64 start = SDL_GetPerformanceCounter();
+    long n = 0;
 
-    // how much to increment pc by after performing instruction
-    u8 pc_increment = 2;
+    I->cycle_limit = (u64)-1;
 
-    if (instrtype == 0x0) {
-        // 0000: miscellaneous
-        // get the 12 remaining bits
-        u16 subcode = srl(instr, 8) & 0xf;
-        u16 rest = instr & 0xff;
-        if (subcode == 0) {
-            // code 0 = 'special' instructions
-            if (rest == 0xff) {
-                // 0x00ff = STOP
-                I->flags &= ~RUN_FLAG;
-                printf("Stop.\n");
-                ok = 1;
-            } else if (rest == 0x01) {
-                // 0x0001 = NOP
-                ok = 1;
-            } else if (rest == 0x02) {
-                // 0x0002 = HALT
-                I->flags |= WAIT_FLAG;
-                ok = 1;
-            } else if (rest == 0x28) {
-                // 0x0028 = CLC
-                // (clear carry flag)
-                I->flags &= ~CARRY_FLAG;
-            } else if (rest == 0xaa) {
-                // 0x00aa = RETURN
-                // pops return address off stack and jumps to it
-                u16 retaddr = load_word(I, I->sp, I->dbr);
-                I->sp += 2;
-                I->pc = retaddr;
-                // don't increase pc
-                pc_increment = 0;
-                ok = 1;
-            } else if (rest == 0xab) {
-                // 0x00ab = RETI
-                // return and enable interrupts
-                u16 retaddr = load_word(I, I->sp, I->dbr);
-                I->sp += 2;
-                I->pc = retaddr;
-                I->flags |= INTERRUPT_ENABLE_NEXT;
-                // don't increase pc
-                pc_increment = 0;
-                ok = 1;
-            } else if (rest == 0xdd) {
-                // 0x00dd = disable interrupts
-                I->flags &= ~INTERRUPT_ENABLE;
-                ok = 1;
-            } else if (rest == 0xee) {
-                // 0x00ee = enable interrupts
-                I->flags |= INTERRUPT_ENABLE_NEXT;
-                ok = 1;
-            }
-        } else if (subcode == 1) {
-            // PUSH
-            //      0000 0001 xxxx ----
-            // xxxx = register to push
-            I->sp -= 2;
-            u8 reg_idx = srl(rest, 4);
-            u16 *push_reg = get_reg(I, reg_idx);
-            store_word(I, I->sp, *push_reg);
-            ok = 1;
-        } else if (subcode == 2) {
-            // POP
-            //      0000 0010 xxxx ----
-            // xxxx = register to pop into
-            u8 reg_idx = srl(rest, 4);
-            u16 *pop_reg = get_reg(I, reg_idx);
-            *pop_reg = load_word(I, I->sp, I->dbr);
-            I->sp += 2;
-            ok = 1;
-        } else if (subcode == 3) {
-            // Jump to register
-            //      0000 0011 xxxx ----
-            // xxx = register containing address to jump to
-            u8 reg_idx = srl(rest, 4);
-            u16 *jump_reg = get_reg(I, reg_idx);
-            I->pc = *jump_reg;
-            // don't increment pc
-            pc_increment = 0;
-            ok = 1;
-        } else if (subcode == 4) {
-            // Swap two registers
-            //      0000 0100 xxxx yyyy
-            // xxxx, yyyy = registers to swap
-            u8 reg_idx1 = srl(rest, 4);
-            u8 reg_idx2 = (rest & 0xf);
-            u16 *r1 = get_reg(I, reg_idx1);
-            u16 *r2 = get_reg(I, reg_idx2);
-            *r1 ^= *r2;
-            *r2 ^= *r1;
-            *r1 ^= *r2;
-            ok = 1;
-        }
-    } else if ((instrtype & 0x8) == 0x8) {
-        // prefix 1 = arithmetic instructions
-        //
-        // format: 1oooooxx xxyyyyyy
-        //
-        //  ooooo = arithmetic operation
-        //   xxxx = dest register (like x86, also a source for eg add)
-        // yyyyyy = other src register, or special value
+    // (a fused pair counts as one step, hence adding fused_pairs back)
+    while (n + fused_pairs < count && (I->flags & RUN_FLAG) && !(I->flags & WAIT_FLAG)) {
+        n += cpu_step(I, (u64)-1);
+    }
+    n += fused_pairs;
 
-        ok = 1;
+    double secs = (double)(SDL_GetPerformanceCounter() - start)
+                    / SDL_GetPerformanceFrequency();
 
-        u8 op       = srl(instr, 10) & 0x1f;
-        u8 dest_idx = srl(instr,  6) &  0xf;
-        u8 src_idx  = srl(instr,  0) & 0x3f;
+    printf("Ran %ld instructions in %.3f s (%.2f million/s)\n",
+            n, secs, n / secs / 1000000.0);
+    print_fusion(n);
+    printf("%" PRIu64 " cycles (%.1fx real speed)\n", I->cycles,
+            I->cycles / secs / (CYCLES_PER_FRAME * FRAMES_PER_SECOND));
+}
 
-        u8 carry = (I->flags & CARRY_FLAG) ? 1 : 0;
+/*
+ * Instruction dispatch
+ *
+ * Rather than picking apart every instruction with a big if/else chain
+ * each time we run it, we decode all 65536 possible instruction words
+ * once at startup (init_instr_table) into a 'decoded' template: which
+ * handler deals with it, which registers it names, how long it is, and
+ * for instructions whose operand fits in the word itself, the operand.
+ *
+ * On top of that, ROM can never change, so predecode_rom turns the
+ * whole ROM into decoded instructions (immediate operands and all) as
+ * soon as it's loaded. When pc is in ROM, do_instr just runs from that
+ * array; code running from RAM goes through the template table and
+ * fetches its operand word by hand.
+ *
+ * Each handler is responsible for advancing pc itself.
+ */
 
-        // reset flags for MATH
-        I->flags &= ~CARRY_FLAG;
-        I->flags &= ~ZERO_FLAG;
+void do_instr(interp *I) {
+    // ROM offset of pc (the upper half of ROM goes through the program bank)
+    u16 pc = I->regs[REG_PC];
+    u32 rom_addr = pc < 0x4000 ? pc : pc + I->regs[REG_PBR] * 0x4000;
 
-        u16 *dest = get_reg(I, dest_idx);
+    if (pc < 0x8000 && !(pc & 1) && rom_addr < ROM_SIZE) {
+        const decoded *d = &rom_code[rom_addr >> 1];
+        if (d->fn) {
+#ifdef DEBUG
+            printf("Instruction @ 0x%04X: 0x%04X\n", pc, d->instr);
+#endif
+            d->fn(I, d);
+            I->cycles += d->cycles;
+            if (d->sets_bank) update_banks(I);
+            return;
+        }
+    }
 
-        u16 srcval;
+    u16 instr = load_word(I, pc, I->code_map);
 
-        if (src_idx < 0x10) {
-            // yy yyyy = 00 rrrr, where rrrr is register ID
-            u16 *src = get_reg(I, src_idx & 0xf);
-            srcval = *src;
-        } else if (src_idx < 0x20) {
-            // yy yyyy = 01 vvvv, where vvvv is a small immediate
-            // value from 0-15 (can be used for immediate bitshifts,
-            // bit testing, etc. where we only need these values)
-            srcval = src_idx & 0xf;
-        } else if (src_idx == 0x20) {
-            // yy yyyy = 10 0000
-            // this means there's a 16-bit immediate value following
-            // the instruction; we use this as the second operand
+#ifdef DEBUG
+    printf("Instruction @ 0x%04X: 0x%04X\n", pc, instr);
+#endif
 
-            // Get the immediate value
-            srcval = load_word(I, I->pc + 2, I->pbr);
-            pc_increment += 2;
-        } else if (src_idx == 0x21) {
-            // yy yyyy = 10 0001
-            // This is just a special code for -1, since it's probably
-            // a common thing and we don't want to waste 16 bits on it.
-            // (e.g. if we want to compare to -1 or w/e)
-            srcval = 0xFFFF;
-        } else if (src_idx >= 0x24 && src_idx < 0x30) {
-            // yy yyyy = 10 vvvv
-            // vvvv = a value from 4 to 15
-            // this is shorthand for (1 << vvvv), so we can do powers
-            // of two without using an extra byte. Handy for bitmasks, etc.
+    decoded d = instr_table[instr];
+    if (d.len == 4) {
+        d.imm = load_word(I, pc + 2, I->code_map);
+    }
+    d.fn(I, &d);
+    I->cycles += d.cycles;
+    if (d.sets_bank) update_banks(I);
+}
 
-            // 1<<0 through 1<<3 (1, 2, 4, 8) are handled by 01vvvv, above.
-            // (since they're less than 15)
-            srcval = 1 << (src_idx - 0x20);
-        } else {
-            // uh I don't know what 0x22 or 0x23 or 0x3? should be yet
-            // but we've got some room here to expand!
-            fprintf(stderr, "Unknown source operand $%X for "
-                    "arithmetic instruction\n", src_idx);
-            srcval = 0;
-            ok = 0;
-        }
-
-        if (op == 0x00) {
-            // Move register/load immediate
-            *dest = srcval;
-        } else if (op == 0x01) {
-            // Addition!
-            if ((int)*dest + (int)srcval > 0xFFFF) I->flags |= CARRY_FLAG;
-            *dest += srcval;
-        } else if (op == 0x02) {
-            // Subtraction
-            if ((int)*dest - (int)srcval < 0) I->flags |= CARRY_FLAG;
-            *dest -= srcval;
-        } else if (op == 0x03) {
-            // Unsigned multiplication
-            if ((u32)*dest * (u32)srcval > 0xFFFF) I->flags |= CARRY_FLAG;
-            *dest = (u16)((u32)*dest * (u32)srcval);
-        } else if (op == 0x04) {
-            // Signed multiplication
-
-            // I think this is right? (I hope this is right...)
-            // First convert to signed, then sign-extend. :/
-            i32 sdest = (i32)(i16)*dest;
-            i32 ssrc = (i32)(i16)srcval;
-            if (sdest * ssrc >= 0x8000) I->flags |= CARRY_FLAG;
-            *dest = (u16)(i16)(sdest * ssrc);
-
-        } else if (op == 0x05) {
-            // Unsigned division
-            *dest /= srcval;
-        } else if (op == 0x06) {
-            // Signed division
-            *dest = ((i16)*dest / (i16)srcval);
-        } else if (op == 0x07) {
-            // Unsigned modulo
-            *dest = ((*dest % srcval) + srcval) % srcval;
-        } else if (op == 0x08) {
-            // Signed modulo
-            // Non-stupid signed modulo, though
-            *dest = (u16)(((i16)*dest % srcval) + srcval) % srcval;
-        } else if (op == 0x09) {
-            // Bitwise AND
-            *dest &= srcval;
-        } else if (op == 0x0a) {
-            // Bitwise OR
-            *dest |= srcval;
-        } else if (op == 0x0b) {
-            // Bitwise XOR
-            *dest ^= srcval;
-        } else if (op == 0x0c) {
-            // Bitwise negation (doesn't use src)
-            *dest = ~*dest;
-        } else if (op == 0x0d) {
-            // Arithmetic negation (doesn't use src)
-            *dest = 0xFFFF - *dest + 1;
-        } else if (op == 0x0e) {
-            // Increment dest (doesn't use src)
-            // (Sets carry flag if the thing wrapped around)
-            if (*dest == 0xFFFF) I->flags |= CARRY_FLAG;
-            (*dest)++;
-        } else if (op == 0x0f) {
-            // Decrement dest (doesn't use src)
-            // (Also sets carry flag if the thing wrapped around)
-            if (*dest == 0x0000) I->flags |= CARRY_FLAG;
-            (*dest)--;
-        } else if (op == 0x10) {
-            // Logical left shift
-            // (Also sets carry flag if the thing wrapped around)
-            if (*dest >= 0x8000) I->flags |= CARRY_FLAG;
-            *dest <<= srcval;
-        } else if (op == 0x11) {
-            // Logical right shift
-            *dest = srl(*dest, srcval);
-        } else if (op == 0x12) {
-            // Arithmetic right shift
-            *dest = sra(*dest, srcval);
-        } else if (op == 0x13) {
-            // Bit rotate left
-            u8 amount = srcval & 0xf;
-            *dest = srl(*dest, 16 - amount) | (u16)(*dest << amount);
-        } else if (op == 0x14) {
-            // Bit rotate right
-            u8 amount = srcval & 0xf;
-            *dest = (*dest << (16 - amount)) | srl(*dest, amount);
-        } else if (op == 0x15) {
-            // Bit test
-            u8 bit = srcval & 0xf;
-            if (!(*dest & (1 << bit))) {
-                I->flags |= ZERO_FLAG;
-            }
-        } else if (op == 0x16) {
-            // Add with carry
-            if ((u32)*dest + (u32)srcval + carry > 0xFFFF) {
-                I->flags |= CARRY_FLAG;
-            }
-            *dest += srcval + carry;
-        } else if (op == 0x17) {
-            // Subtract with carry
-            if ((i32)*dest - (i32)srcval - carry < 0x0000) {
-                I->flags |= CARRY_FLAG;
-            }
-            *dest -= srcval + carry;
-        } else if (op == 0x18) {
-            // Multiply with carry
-            if ((u32)*dest * (u32)srcval + carry > 0xFFFF) {
-                I->flags |= CARRY_FLAG;
-            }
-            *dest = *dest * srcval + carry;
-        /* unused operation space here */
-        } else if (op == 0x1e) {
-            // Unsigned comparison
-            if (*dest < srcval) I->flags |= CARRY_FLAG;
-            if (*dest == srcval) I->flags |= ZERO_FLAG;
-        } else if (op == 0x1f) {
-            // Signed comparison
-            if ((i16)*dest < (i16)srcval) I->flags |= CARRY_FLAG;
-            if (*dest == srcval) I->flags |= ZERO_FLAG;
-        } else {
-            ok = 0;
+void op_unknown(interp *I, const decoded *d) {
+    // TODO put up a dialogue box or something on error! jeez, rude
+    printf("Unknown opcode: $%X at PC $%X\n", d->instr, I->regs[REG_PC]);
+#ifdef DEBUG
+    debug_counter = 0;
+#else
+    // crash :(
+    I->flags &= ~RUN_FLAG;
+    I->flags |= CRASH_FLAG;
+#endif
+}
+
+/* 0000: miscellaneous */
+
+void op_stop(interp *I, const decoded *d) {
+    // 0x00ff = STOP
+    I->flags &= ~RUN_FLAG;
+    printf("Stop.\n");
+    I->regs[REG_PC] += 2;
+}
+
+void op_nop(interp *I, const decoded *d) {
+    // 0x0001 = NOP
+    I->regs[REG_PC] += 2;
+}
+
+void op_halt(interp *I, const decoded *d) {
+    // 0x0002 = HALT
+    I->flags |= WAIT_FLAG;
+    I->regs[REG_PC] += 2;
+}
+
+void op_clc(interp *I, const decoded *d) {
+    // 0x0028 = CLC
+    // (clear carry flag)
+    sync_flags(I);
+    I->flags &= ~CARRY_FLAG;
+    I->regs[REG_PC] += 2;
+}
+
+void op_ret(interp *I, const decoded *d) {
+    // 0x00aa = RETURN
+    // pops return address off stack and jumps to it
+    u16 retaddr = load_word(I, I->regs[REG_SP], I->data_map);
+    I->regs[REG_SP] += 2;
+    I->regs[REG_PC] = retaddr;
+}
+
+void op_reti(interp *I, const decoded *d) {
+    // 0x00ab = RETI
+    // return and enable interrupts
+    u16 retaddr = load_word(I, I->regs[REG_SP], I->data_map);
+    I->regs[REG_SP] += 2;
+    I->regs[REG_PC] = retaddr;
+    I->flags |= INTERRUPT_ENABLE_NEXT;
+}
+
+void op_di(interp *I, const decoded *d) {
+    // 0x00dd = disable interrupts
+    I->flags &= ~INTERRUPT_ENABLE;
+    I->regs[REG_PC] += 2;
+}
+
+void op_ei(interp *I, const decoded *d) {
+    // 0x00ee = enable interrupts
+    I->flags |= INTERRUPT_ENABLE_NEXT;
+    I->regs[REG_PC] += 2;
+}
+
+void op_push(interp *I, const decoded *d) {
+    // PUSH
+    //      0000 0001 xxxx ----
+    // xxxx = register to push
+    I->regs[REG_SP] -= 2;
+    u16 *push_reg = get_reg(I, d->x);
+    store_word(I, I->regs[REG_SP], *push_reg);
+    I->regs[REG_PC] += 2;
+}
+
+void op_pop(interp *I, const decoded *d) {
+    // POP
+    //      0000 0010 xxxx ----
+    // xxxx = register to pop into
+    u16 *pop_reg = get_reg(I, d->x);
+    *pop_reg = load_word(I, I->regs[REG_SP], I->data_map);
+    I->regs[REG_SP] += 2;
+    I->regs[REG_PC] += 2;
+}
+
+void op_jr(interp *I, const decoded *d) {
+    // Jump to register
+    //      0000 0011 xxxx ----
+    // xxx = register containing address to jump to
+    u16 *jump_reg = get_reg(I, d->x);
+    I->regs[REG_PC] = *jump_reg;
+}
+
+void op_swap(interp *I, const decoded *d) {
+    // Swap two registers
+    //      0000 0100 xxxx yyyy
+    // xxxx, yyyy = registers to swap
+    u16 *r1 = get_reg(I, d->x);
+    u16 *r2 = get_reg(I, d->y);
+    *r1 ^= *r2;
+    *r2 ^= *r1;
+    *r1 ^= *r2;
+    I->regs[REG_PC] += 2;
+}
+
+/*
+ * 1: arithmetic instructions
+ *
+ * Each operation is a little function that takes the destination
+ * register and the already-decoded source value. alu_exec does the
+ * flag bookkeeping that's common to all of them, and ALU_HANDLERS
+ * stamps out a handler for register sources and one for everything
+ * else (constants and immediates, which the decoder has already turned
+ * into d->imm for us).
+ *
+ * None of them touch the flags. alu_exec just writes down what
+ * happened (lf_op and friends) and alu_flags works out carry and zero
+ * from that if anyone ever asks.
+ */
+
+typedef void (*alu_fn)(interp *I, u16 *dest, u16 srcval, u8 carry);
+
+// values for the source operand codes that don't need a register or
+// a following word (small immediates, -1 and powers of two)
+u16 alu_consts[64];
+
+static inline void alu_mov(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Move register/load immediate
+    *dest = srcval;
+}
+
+static inline void alu_add(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Addition!
+    *dest += srcval;
+}
+
+static inline void alu_sub(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Subtraction
+    *dest -= srcval;
+}
+
+static inline void alu_mul(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Unsigned multiplication
+    *dest = (u16)((u32)*dest * (u32)srcval);
+}
+
+static inline void alu_muls(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Signed multiplication
+
+    // I think this is right? (I hope this is right...)
+    // First convert to signed, then sign-extend. :/
+    i32 sdest = (i32)(i16)*dest;
+    i32 ssrc = (i32)(i16)srcval;
+    *dest = (u16)(i16)(sdest * ssrc);
+}
+
+static inline void alu_div(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Unsigned division
+    *dest /= srcval;
+}
+
+static inline void alu_divs(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Signed division
+    *dest = ((i16)*dest / (i16)srcval);
+}
+
+static inline void alu_mod(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Unsigned modulo
+    *dest = ((*dest % srcval) + srcval) % srcval;
+}
+
+static inline void alu_mods(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Signed modulo
+    // Non-stupid signed modulo, though
+    *dest = (u16)(((i16)*dest % srcval) + srcval) % srcval;
+}
+
+static inline void alu_and(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Bitwise AND
+    *dest &= srcval;
+}
+
+static inline void alu_or(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Bitwise OR
+    *dest |= srcval;
+}
+
+static inline void alu_xor(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Bitwise XOR
+    *dest ^= srcval;
+}
+
+static inline void alu_cpl(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Bitwise negation (doesn't use src)
+    *dest = ~*dest;
+}
+
+static inline void alu_neg(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Arithmetic negation (doesn't use src)
+    *dest = 0xFFFF - *dest + 1;
+}
+
+static inline void alu_inc(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Increment dest (doesn't use src)
+    // (Sets carry flag if the thing wrapped around)
+    (*dest)++;
+}
+
+static inline void alu_dec(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Decrement dest (doesn't use src)
+    // (Also sets carry flag if the thing wrapped around)
+    (*dest)--;
+}
+
+static inline void alu_sll(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Logical left shift
+    // (Also sets carry flag if the thing wrapped around)
+    *dest <<= srcval;
+}
+
+static inline void alu_srl(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Logical right shift
+    *dest = srl(*dest, srcval);
+}
+
+static inline void alu_sra(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Arithmetic right shift
+    *dest = sra(*dest, srcval);
+}
+
+static inline void alu_rbl(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Bit rotate left
+    u8 amount = srcval & 0xf;
+    *dest = srl(*dest, 16 - amount) | (u16)(*dest << amount);
+}
+
+static inline void alu_rbr(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Bit rotate right
+    u8 amount = srcval & 0xf;
+    *dest = (*dest << (16 - amount)) | srl(*dest, amount);
+}
+
+static inline void alu_bit(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Bit test (only sets the zero flag)
+}
+
+static inline void alu_addc(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Add with carry
+    *dest += srcval + carry;
+}
+
+static inline void alu_subc(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Subtract with carry
+    *dest -= srcval + carry;
+}
+
+static inline void alu_mulc(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Multiply with carry
+    *dest = *dest * srcval + carry;
+}
+
+static inline void alu_cmp(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Unsigned comparison (only sets flags)
+}
+
+static inline void alu_cmps(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    // Signed comparison (only sets flags)
+}
+
+static inline void alu_unused(interp *I, u16 *dest, u16 srcval, u8 carry) {
+    /* unused operation space ($19 - $1d) */
+}
+
+alu_fn alu_ops[32] = {
+    alu_mov,    alu_add,    alu_sub,    alu_mul,
+    alu_muls,   alu_div,    alu_divs,   alu_mod,
+    alu_mods,   alu_and,    alu_or,     alu_xor,
+    alu_cpl,    alu_neg,    alu_inc,    alu_dec,
+    alu_sll,    alu_srl,    alu_sra,    alu_rbl,
+    alu_rbr,    alu_bit,    alu_addc,   alu_subc,
+    alu_mulc,   alu_unused, alu_unused, alu_unused,
+    alu_unused, alu_unused, alu_cmp,    alu_cmps,
+};
+
+static inline u16 alu_flags(interp *I) {
+    // Carry and zero as the last ALU operation left them.
+    u16 a = I->lf_a;
+    u16 b = I->lf_b;
+    u8 c = I->lf_carry;
+    int carry = 0;
+    // comparisons set the zero flag themselves
+    int zero = I->lf_res == 0;
+
+    switch (I->lf_op) {
+        case 0x01: carry = (u32)a + (u32)b > 0xFFFF; break;             // add
+        case 0x02: carry = a < b; break;                                // sub
+        case 0x03: carry = (u32)a * (u32)b > 0xFFFF; break;             // mul
+        // (only positive overflow counts, same as it always has)
+        case 0x04: carry = (i32)(i16)a * (i32)(i16)b >= 0x8000; break;  // muls
+        case 0x0e: carry = a == 0xFFFF; break;                          // inc
+        case 0x0f: carry = a == 0x0000; break;                          // dec
+        // (whatever the shift amount, it's just the top bit)
+        case 0x10: carry = a >= 0x8000; break;                          // sll
+        // (dest is untouched, so this covers dest == 0 as well)
+        case 0x15: zero = !(a & (1 << (b & 0xf))); break;               // bit
+        case 0x16: carry = (u32)a + (u32)b + c > 0xFFFF; break;         // addc
+        case 0x17: carry = (i32)a - (i32)b - c < 0x0000; break;         // subc
+        case 0x18: carry = (u32)a * (u32)b + c > 0xFFFF; break;         // mulc
+        case 0x1e: carry = a < b; zero = a == b; break;                 // cmp
+        case 0x1f: carry = (i16)a < (i16)b; zero = a == b; break;       // cmps
+    }
+
+    return (carry ? CARRY_FLAG : 0) | (zero ? ZERO_FLAG : 0);
+}
+
+void sync_flags(interp *I) {
+    // Bring carry and zero in flags up to date. Anything that looks at
+    // them has to call this first.
+    if (I->lf_op != LF_NONE) {
+        I->flags = (I->flags & ~(CARRY_FLAG | ZERO_FLAG)) | alu_flags(I);
+        I->lf_op = LF_NONE;
+    }
+}
+
+static inline u16 cur_flags(interp *I) {
+    sync_flags(I);
+    return I->flags;
+}
+
+static inline void alu_exec(interp *I, const decoded *d, u16 srcval, u8 op, alu_fn fn) {
+    // format: 1oooooxx xxyyyyyy
+    //
+    //  ooooo = arithmetic operation
+    //   xxxx = dest register (like x86, also a source for eg add)
+    // yyyyyy = other src register, or special value
+    u8 carry = 0;
+
+    // only the with-carry ones need the old carry
+    if (op >= 0x16 && op <= 0x18) {
+        sync_flags(I);
+        carry = (I->flags & CARRY_FLAG) ? 1 : 0;
+        I->lf_carry = carry;
+    }
+
+    u16 *dest = get_reg(I, d->x);
+
+    I->lf_op = op;
+    I->lf_a = *dest;
+    I->lf_b = srcval;
+
+    fn(I, dest, srcval, carry);
+
+    I->lf_res = *dest;
+}
+
+#define ALU_HANDLERS(name, op)                                      \
+    void name##_reg(interp *I, const decoded *d) {                  \
+        alu_exec(I, d, *get_reg(I, d->y), op, alu_##name);          \
+        I->regs[REG_PC] += 2;                                       \
+    }                                                               \
+    void name##_val(interp *I, const decoded *d) {                  \
+        alu_exec(I, d, d->imm, op, alu_##name);                     \
+        I->regs[REG_PC] += d->len;                                  \
+    }
+
+ALU_HANDLERS(mov,  0x00)
+ALU_HANDLERS(add,  0x01)
+ALU_HANDLERS(sub,  0x02)
+ALU_HANDLERS(mul,  0x03)
+ALU_HANDLERS(muls, 0x04)
+ALU_HANDLERS(div,  0x05)
+ALU_HANDLERS(divs, 0x06)
+ALU_HANDLERS(mod,  0x07)
+ALU_HANDLERS(mods, 0x08)
+ALU_HANDLERS(and,  0x09)
+ALU_HANDLERS(or,   0x0a)
+ALU_HANDLERS(xor,  0x0b)
+ALU_HANDLERS(cpl,  0x0c)
+ALU_HANDLERS(neg,  0x0d)
+ALU_HANDLERS(inc,  0x0e)
+ALU_HANDLERS(dec,  0x0f)
+ALU_HANDLERS(sll,  0x10)
+ALU_HANDLERS(srl,  0x11)
+ALU_HANDLERS(sra,  0x12)
+ALU_HANDLERS(rbl,  0x13)
+ALU_HANDLERS(rbr,  0x14)
+ALU_HANDLERS(bit,  0x15)
+ALU_HANDLERS(addc, 0x16)
+ALU_HANDLERS(subc, 0x17)
+ALU_HANDLERS(mulc, 0x18)
+ALU_HANDLERS(cmp,  0x1e)
+ALU_HANDLERS(cmps, 0x1f)
+
+instr_handler alu_handlers[32][2] = {
+#define ALU_ENTRY(name) { name##_reg, name##_val }
+    ALU_ENTRY(mov),  ALU_ENTRY(add),  ALU_ENTRY(sub),  ALU_ENTRY(mul),
+    ALU_ENTRY(muls), ALU_ENTRY(div),  ALU_ENTRY(divs), ALU_ENTRY(mod),
+    ALU_ENTRY(mods), ALU_ENTRY(and),  ALU_ENTRY(or),   ALU_ENTRY(xor),
+    ALU_ENTRY(cpl),  ALU_ENTRY(neg),  ALU_ENTRY(inc),  ALU_ENTRY(dec),
+    ALU_ENTRY(sll),  ALU_ENTRY(srl),  ALU_ENTRY(sra),  ALU_ENTRY(rbl),
+    ALU_ENTRY(rbr),  ALU_ENTRY(bit),  ALU_ENTRY(addc), ALU_ENTRY(subc),
+    ALU_ENTRY(mulc), { 0 }, { 0 }, { 0 },
+    { 0 }, { 0 }, ALU_ENTRY(cmp),  ALU_ENTRY(cmps),
+#undef ALU_ENTRY
+};
+
+void alu_unused_op(interp *I, const decoded *d) {
+    // The flags still get reset (and the zero flag set from dest)
+    // before we notice there's no such operation.
+    alu_exec(I, d, 0, 0x19, alu_unused);
+    op_unknown(I, d);
+}
+
+void alu_bad_src(interp *I, const decoded *d) {
+    // uh I don't know what 0x22 or 0x23 or 0x3? should be yet
+    // but we've got some room here to expand!
+    u8 op = (d->instr >> 10) & 0x1f;
+    fprintf(stderr, "Unknown source operand $%X for "
+            "arithmetic instruction\n", d->instr & 0x3f);
+    alu_exec(I, d, 0, op, alu_ops[op]);
+    op_unknown(I, d);
+}
+
+/*
+ * 01: jumps
+ *
+ * One handler per condition for each of the relative and absolute
+ * forms. For relative jumps the decoder has already sign-extended the
+ * offset into d->imm; for absolute jumps d->imm is the address.
+ */
+
+static inline u16 jump_offset(u16 instr) {
+    // sign-extend from 10 to 16 bits, then convert from words to bytes
+    return ((int)((instr & 0x03ff) ^ 0x0200) - 0x0200) * 2;
+}
+
+#define JUMP_HANDLERS(name, cond)                                   \
+    void name##_rel(interp *I, const decoded *d) {                  \
+        if (cond) {                                                 \
+            I->regs[REG_PC] += d->imm;                              \
+        } else {                                                    \
+            I->regs[REG_PC] += 2;                                   \
+        }                                                           \
+    }                                                               \
+    void name##_abs(interp *I, const decoded *d) {                  \
+        if (cond) {                                                 \
+            I->regs[REG_PC] = d->imm;                               \
+        } else {                                                    \
+            /* if not jumping, need to jump over immediate address */ \
+            I->regs[REG_PC] += 4;                                   \
+        }                                                           \
+    }
+
+JUMP_HANDLERS(jmp, 1)
+JUMP_HANDLERS(jz,  (cur_flags(I) & ZERO_FLAG))
+JUMP_HANDLERS(jnz, !(cur_flags(I) & ZERO_FLAG))
+JUMP_HANDLERS(jc,  (cur_flags(I) & CARRY_FLAG))
+JUMP_HANDLERS(jnc, !(cur_flags(I) & CARRY_FLAG))
+JUMP_HANDLERS(jle, (cur_flags(I) & (ZERO_FLAG | CARRY_FLAG)))
+JUMP_HANDLERS(jgt, !(cur_flags(I) & (ZERO_FLAG | CARRY_FLAG)))
+
+void jsr_rel(interp *I, const decoded *d) {
+    // push return address for subroutine call
+    I->regs[REG_SP] -= 2;
+    store_word(I, I->regs[REG_SP], I->regs[REG_PC] + 2);
+    I->regs[REG_PC] += d->imm;
+}
+
+void jsr_abs(interp *I, const decoded *d) {
+    I->regs[REG_SP] -= 2;
+    store_word(I, I->regs[REG_SP], I->regs[REG_PC] + 4);
+    I->regs[REG_PC] = d->imm;
+}
+
+void jump_unknown(interp *I, const decoded *d) {
+    // * TODO add signed jumps *
+    fprintf(stderr, "Unknown jump condition %d\n", (d->instr >> 10) & 0xf);
+    I->regs[REG_PC] += d->len;
+}
+
+instr_handler jump_handlers[16][2] = {
+    { jmp_rel, jmp_abs }, { jz_rel, jz_abs },   { jnz_rel, jnz_abs },
+    { jc_rel, jc_abs },   { jnc_rel, jnc_abs }, { jle_rel, jle_abs },
+    { jgt_rel, jgt_abs },
+    [15] = { jsr_rel, jsr_abs },
+};
+
+/*
+ * Fused compare-and-branch
+ *
+ * predecode_rom swaps cmp/inc/dec/etc. followed by a conditional jump
+ * for one of these, which does the arithmetic and
+ * then the jump (found right after it in rom_code) in one go. Flags
+ * still get written exactly as before, since anything could read them
+ * later. The arithmetic instruction's own decoded entry only has its
+ * own cycles in it; the jump's get added here if we actually do it.
+ */
+
+// fused pairs run, and times we had to stop after the first half
+u64 fused_pairs = 0;
+u64 fused_splits = 0;
+
+// which flags each condition looks at, and whether it jumps when
+// they're set (jz, jc, jle) or clear (jnz, jnc, jgt)
+const u16 jcc_mask[7] = {
+    0, ZERO_FLAG, ZERO_FLAG, CARRY_FLAG, CARRY_FLAG,
+    ZERO_FLAG | CARRY_FLAG, ZERO_FLAG | CARRY_FLAG,
+};
+const u8 jcc_if_set[7] = { 0, 1, 0, 1, 0, 1, 0 };
+
+static inline void fused_jump(interp *I, const decoded *d) {
+    const decoded *j = d + d->len / 2;
+
+    I->regs[REG_PC] += d->len;
+
+    // if the jump would start at or after the end of the slice, the
+    // run loop has to get a look in between the two
+    if (I->cycles + d->cycles >= I->cycle_limit) {
+        fused_splits++;
+        return;
+    }
+
+    u8 cond = (j->instr >> 10) & 0xf;
+    int set = (cur_flags(I) & jcc_mask[cond]) != 0;
+
+    if (set != jcc_if_set[cond]) {
+        I->regs[REG_PC] += j->len;
+    } else if (j->instr & 0x03ff) {
+        I->regs[REG_PC] += j->imm;
+    } else {
+        I->regs[REG_PC] = j->imm;
+    }
+    I->cycles += j->cycles;
+    fused_pairs++;
+}
+
+#define FUSED_HANDLERS(name, op)                                    \
+    void name##_reg_jcc(interp *I, const decoded *d) {              \
+        alu_exec(I, d, *get_reg(I, d->y), op, alu_##name);          \
+        fused_jump(I, d);                                           \
+    }                                                               \
+    void name##_val_jcc(interp *I, const decoded *d) {              \
+        alu_exec(I, d, d->imm, op, alu_##name);                     \
+        fused_jump(I, d);                                           \
+    }
+
+FUSED_HANDLERS(sub,  0x02)
+FUSED_HANDLERS(and,  0x09)
+FUSED_HANDLERS(inc,  0x0e)
+FUSED_HANDLERS(dec,  0x0f)
+FUSED_HANDLERS(bit,  0x15)
+FUSED_HANDLERS(cmp,  0x1e)
+FUSED_HANDLERS(cmps, 0x1f)
+
+instr_handler fused_handlers[32][2] = {
+#define FUSED_ENTRY(name) { name##_reg_jcc, name##_val_jcc }
+    [0x02] = FUSED_ENTRY(sub),
+    [0x09] = FUSED_ENTRY(and),
+    [0x0e] = FUSED_ENTRY(inc),
+    [0x0f] = FUSED_ENTRY(dec),
+    [0x15] = FUSED_ENTRY(bit),
+    [0x1e] = FUSED_ENTRY(cmp),
+    [0x1f] = FUSED_ENTRY(cmps),
+#undef FUSED_ENTRY
+};
+
+/*
+ * 001: load/store instructions
+ *
+ * Same idea as the arithmetic ones; one handler per operation for each
+ * addressing mode.
+ */
+
+static inline void ls_lw(interp *I, u16 *reg, u16 addr) {
+    // Load word
+    *reg = load_word(I, addr, I->data_map);
+}
+
+static inline void ls_lb(interp *I, u16 *reg, u16 addr) {
+    // Load byte
+    *reg = load_byte(I, addr, I->data_map);
+}
+
+static inline void ls_sw(interp *I, u16 *reg, u16 addr) {
+    // Store word
+    store_word(I, addr, *reg);
+}
+
+static inline void ls_sb(interp *I, u16 *reg, u16 addr) {
+    // Store byte
+    store_byte(I, addr, (*reg) & 0xff);
+}
+
+typedef void (*ls_fn)(interp *I, u16 *reg, u16 addr);
+
+ls_fn ls_ops[4] = { ls_lw, ls_lb, ls_sw, ls_sb };
+
+// yy yyyy = 00 rrrr: address in register rrrr
+//           01 rrrr: address in rrrr + imm. offset following
+//           10 0000: no register, immediate address following
+#define LOADSTORE_HANDLERS(name)                                    \
+    void name##_reg(interp *I, const decoded *d) {                  \
+        u16 addr = *get_reg(I, d->y);                               \
+        ls_##name(I, get_reg(I, d->x), addr);                       \
+        I->regs[REG_PC] += 2;                                       \
+    }                                                               \
+    void name##_regimm(interp *I, const decoded *d) {               \
+        u16 addr = *get_reg(I, d->y) + d->imm;                      \
+        ls_##name(I, get_reg(I, d->x), addr);                       \
+        I->regs[REG_PC] += 4;                                       \
+    }                                                               \
+    void name##_imm(interp *I, const decoded *d) {                  \
+        ls_##name(I, get_reg(I, d->x), d->imm);                     \
+        I->regs[REG_PC] += 4;                                       \
+    }
+
+LOADSTORE_HANDLERS(lw)
+LOADSTORE_HANDLERS(lb)
+LOADSTORE_HANDLERS(sw)
+LOADSTORE_HANDLERS(sb)
+
+instr_handler loadstore_handlers[4][3] = {
+    { lw_reg, lw_regimm, lw_imm },
+    { lb_reg, lb_regimm, lb_imm },
+    { sw_reg, sw_regimm, sw_imm },
+    { sb_reg, sb_regimm, sb_imm },
+};
+
+void loadstore_bad_mode(interp *I, const decoded *d) {
+    fprintf(stderr, "Unknown address mode $%X for load/store "
+            "(pc: $%04X)\n", d->instr & 0x3f, I->regs[REG_PC]);
+    ls_ops[(d->instr >> 11) & 0x3](I, get_reg(I, d->x), 0);
+    op_unknown(I, d);
+}
+
+/*
+ * Cycle costs
+ *
+ * Each word read out of the instruction stream costs CYC_FETCH, each
+ * memory access (load, store, and anything that goes through the stack)
+ * costs CYC_MEM, and multiply/divide cost extra on top. None of it
+ * depends on what happens when the instruction runs (a jump costs the
+ * same taken or not), so it all gets worked out at decode time.
+ */
+
+#define CYC_FETCH 2
+#define CYC_MEM 2
+// taking an interrupt: push pc, fetch from the vector
+#define CYC_INTERRUPT (CYC_FETCH + CYC_MEM)
+
+// extra cycles for the slow arithmetic ops
+const u8 alu_cycles[32] = {
+    [0x03] = 6,     // mul
+    [0x04] = 6,     // muls
+    [0x05] = 16,    // div
+    [0x06] = 16,    // divs
+    [0x07] = 16,    // mod
+    [0x08] = 16,    // mods
+    [0x18] = 6,     // mulc
+};
+
+u8 cycle_cost(const decoded *d) {
+    u16 instr = d->instr;
+    u8 cycles = CYC_FETCH * (d->len / 2);
+
+    if ((instr & 0xf000) == 0x0000) {
+        if (d->fn == op_push || d->fn == op_pop || d->fn == op_ret || d->fn == op_reti) {
+            cycles += CYC_MEM;
         }
+    } else if ((instr & 0x8000) == 0x8000) {
+        cycles += alu_cycles[(instr >> 10) & 0x1f];
+    } else if ((instr & 0xc000) == 0x4000) {
+        // jsr pushes the return address
+        if (((instr >> 10) & 0xf) == 15) cycles += CYC_MEM;
+    } else if ((instr & 0xe000) == 0x2000) {
+        cycles += CYC_MEM;
+    }
 
-        if (*dest == 0 && op < 0x1e) {
-            I->flags |= ZERO_FLAG;
+    return cycles;
+}
+
+u8 writes_bank(const decoded *d) {
+    // Can this instruction change dbr or pbr? (anything that writes
+    // register x, plus swap which writes both)
+    u16 instr = d->instr;
+    int x_bank = d->x == 12 || d->x == 13;
+
+    if (d->fn == op_pop) return x_bank;
+    if (d->fn == op_swap) return x_bank || d->y == 12 || d->y == 13;
+    if ((instr & 0x8000) == 0x8000) {
+        return x_bank && d->fn != alu_bad_src && d->fn != alu_unused_op;
+    }
+    if ((instr & 0xe000) == 0x2000) {
+        // loads only
+        return x_bank && !(instr & 0x1000) && d->fn != loadstore_bad_mode;
+    }
+    return 0;
+}
+
+decoded decode_instr(u16 instr) {
+    decoded d;
+    d.fn = op_unknown;
+    d.instr = instr;
+    d.imm = 0;
+    d.len = 2;
+    d.x = 0;
+    d.y = 0;
+    d.cycles = 0;
+    d.sets_bank = 0;
+
+    if ((instr & 0xf000) == 0x0000) {
+        // 0000: miscellaneous
+        u16 subcode = (instr >> 8) & 0xf;
+        u16 rest = instr & 0xff;
+        d.x = (rest >> 4) & 0xf;
+        d.y = rest & 0xf;
+        if (subcode == 0) {
+            // code 0 = 'special' instructions
+            switch (rest) {
+                case 0xff: d.fn = op_stop; break;
+                case 0x01: d.fn = op_nop;  break;
+                case 0x02: d.fn = op_halt; break;
+                case 0x28: d.fn = op_clc;  break;
+                case 0xaa: d.fn = op_ret;  break;
+                case 0xab: d.fn = op_reti; break;
+                case 0xdd: d.fn = op_di;   break;
+                case 0xee: d.fn = op_ei;   break;
+            }
+        } else if (subcode == 1) {
+            d.fn = op_push;
+        } else if (subcode == 2) {
+            d.fn = op_pop;
+        } else if (subcode == 3) {
+            d.fn = op_jr;
+        } else if (subcode == 4) {
+            d.fn = op_swap;
+        }
+    } else if ((instr & 0x8000) == 0x8000) {
+        // prefix 1 = arithmetic instructions
+        u8 op      = (instr >> 10) & 0x1f;
+        u8 src_idx = instr & 0x3f;
+
+        d.x = (instr >> 6) & 0xf;
+        d.y = src_idx & 0xf;
+
+        if (src_idx == 0x22 || src_idx == 0x23 || src_idx >= 0x30) {
+            d.fn = alu_bad_src;
+        } else if (!alu_handlers[op][0]) {
+            d.fn = alu_unused_op;
+        } else if (src_idx < 0x10) {
+            d.fn = alu_handlers[op][0];
+        } else {
+            d.fn = alu_handlers[op][1];
+            d.imm = alu_consts[src_idx];
+            // yy yyyy = 10 0000
+            // this means there's a 16-bit immediate value following
+            // the instruction; we use this as the second operand
+            if (src_idx == 0x20) d.len = 4;
         }
-    } else if ((instrtype & 0xc) == 0x4) {
+    } else if ((instr & 0xc000) == 0x4000) {
         // prefix 01: jump
         //
         //      01ooooaa aaaaaaaa
@@ -947,138 +2399,802 @@ void do_instr(interp *I) {
         //           value following the instruction as
         //           the address to jump to, rather than
         //           a relative jump direction)
-        u8  op       = srl(instr, 10) &    0xf;
-        u16 offset   = srl(instr,  0) & 0x03ff;
-
-        u8 should_jump = 0;
-
-        switch (op) {
-            case  0: should_jump = 1; break;
-            case  1: should_jump = (I->flags & ZERO_FLAG); break;
-            case  2: should_jump = !(I->flags & ZERO_FLAG); break;
-            case  3: should_jump = (I->flags & CARRY_FLAG); break;
-            case  4: should_jump = !(I->flags & CARRY_FLAG); break;
-            case  5: should_jump = (I->flags & (ZERO_FLAG | CARRY_FLAG)); break;
-            case  6: should_jump = !(I->flags & (ZERO_FLAG | CARRY_FLAG)); break;
-            case 15: should_jump = 1; break;
-            default: fprintf(stderr, "Unknown jump condition %d\n", op);
-        }
-
-        //if (op != 0 && op != 15) printf("jump type: %d; should jump? %d\n", op, should_jump);
-
-        if (should_jump) {
-            if (op == 15) {
-                // push return address for subroutine call
-                I->sp -= 2;
-                if (offset == 0) {
-                    store_word(I, I->sp, I->pc + 4);
-                } else {
-                    store_word(I, I->sp, I->pc + 2);
-                }
-            }
-
-            if (offset != 0) {
-                // relative jump
-                // sign-extend from 10 to 16 bits
-                u16 signbit = offset & 0x0200;
-                i16 soffset = (signed) offset;
+        u8 op = (instr >> 10) & 0xf;
+        int relative = (instr & 0x03ff) != 0;
 
-                if (signbit) {
-                    soffset -= 0x0400;
-                }
-
-                I->pc += soffset * 2;
-            } else {
-                // absolute jump
-                u16 new_addr = load_word(I, I->pc + 2, I->pbr);
-                I->pc = new_addr;
-            }
-
-            // don't advance pc
-            pc_increment = 0;
-        } else if (offset == 0) {
-            // if not jumping, need to jump over immediate address
-            pc_increment += 2;
+        if (relative) {
+            d.imm = jump_offset(instr);
+        } else {
+            d.len = 4;
         }
 
-
-        ok = 1;
-    } else if ((instrtype & 0xe) == 0x2) {
+        if (!jump_handlers[op][0]) {
+            d.fn = jump_unknown;
+        } else {
+            d.fn = jump_handlers[op][relative ? 0 : 1];
+        }
+    } else if ((instr & 0xe000) == 0x2000) {
         // prefix 001: Load/store instructions
         //      001ooxxx x0yyyyyy
         //     oo = operation type (load/store word/byte)
         //   xxxx = register to load/store into/from
         // yyyyyy = register w/ memory location (possibly imm. offset follows)
+        u8 op     = (instr >> 11) & 0x3;
+        u8 mem_id = instr & 0x3f;
 
-        ok = 1;
-
-        u8 op     = srl(instr, 11) &  0x3;
-        u8 reg_id = srl(instr,  7) &  0xf;
-        u8 mem_id = srl(instr,  0) & 0x3f;
-
-        u16 *reg = get_reg(I, reg_id);
+        d.x = (instr >> 7) & 0xf;
+        d.y = mem_id & 0xf;
 
-        u16 addr;
         if (mem_id < 0x10) {
-            // yy yyyy = 00 rrrr; address in register rrrr
-            addr = *get_reg(I, mem_id & 0xf);
+            d.fn = loadstore_handlers[op][0];
         } else if (mem_id < 0x20) {
-            // yy yyyy = 01 rrrr; address in rrrr + imm. offset following
-            addr = *get_reg(I, mem_id & 0xf);
-            addr += load_word(I, I->pc + 2, I->dbr);
-            pc_increment += 2;
+            d.fn = loadstore_handlers[op][1];
+            d.len = 4;
         } else if (mem_id == 0x20) {
-            // yy yyyy = 10 0000; no register, immediate address following
-            addr = load_word(I, I->pc + 2, I->dbr);
-            pc_increment += 2;
+            d.fn = loadstore_handlers[op][2];
+            d.len = 4;
         } else {
-            fprintf(stderr, "Unknown address mode $%X for load/store "
-                    "(pc: $%04X)\n", mem_id, I->pc);
-            addr = 0;
-            ok = 0;
-        }
-
-        if (op == 0) {
-            // Load word
-            *reg = load_word(I, addr, I->dbr);
-            //printf("Load word at $%04X: $%04X\n", addr, *reg);
-        } else if (op == 1) {
-            // Load byte
-            *reg = load_byte(I, addr, I->dbr);
-            //printf("Load byte at $%04X: $%02X\n", addr, *reg);
-        } else if (op == 2) {
-            // Store word
-            store_word(I, addr, *reg);
-            //printf("Store word $%04X at $%04X\n", *reg, addr);
-        } else if (op == 3) {
-            // Store byte
-            store_byte(I, addr, (*reg) & 0xff);
-            //printf("Store byte $%02X at $%04X\n", *reg, addr);
+            d.fn = loadstore_bad_mode;
         }
     }
     /* unused instruction space: prefix 0001 isn't anything */
 
-    if (!ok) {
-        // TODO put up a dialogue box or something on error! jeez, rude
-        printf("Unknown opcode: $%X at PC $%X\n", instr, I->pc);
-#ifdef DEBUG
-        debug_counter = 0;
+    d.cycles = cycle_cost(&d);
+    d.sets_bank = writes_bank(&d);
+
+    return d;
+}
+
+void init_instr_table() {
+    for (int i = 0; i < 64; i++) {
+        if (i >= 0x10 && i < 0x20) {
+            // yy yyyy = 01 vvvv, where vvvv is a small immediate
+            // value from 0-15 (can be used for immediate bitshifts,
+            // bit testing, etc. where we only need these values)
+            alu_consts[i] = i & 0xf;
+        } else if (i == 0x21) {
+            // yy yyyy = 10 0001
+            // This is just a special code for -1, since it's probably
+            // a common thing and we don't want to waste 16 bits on it.
+            // (e.g. if we want to compare to -1 or w/e)
+            alu_consts[i] = 0xFFFF;
+        } else if (i >= 0x24 && i < 0x30) {
+            // yy yyyy = 10 vvvv
+            // vvvv = a value from 4 to 15
+            // this is shorthand for (1 << vvvv), so we can do powers
+            // of two without using an extra byte. Handy for bitmasks, etc.
+
+            // 1<<0 through 1<<3 (1, 2, 4, 8) are handled by 01vvvv, above.
+            // (since they're less than 15)
+            alu_consts[i] = 1 << (i - 0x20);
+        } else {
+            alu_consts[i] = 0;
+        }
+    }
+
+    for (int i = 0; i < 65536; i++) {
+        instr_table[i] = decode_instr(i);
+    }
+}
+
+void predecode_rom(u8 *rom) {
+    // The lower 16k of ROM is always mapped at $0000, and each 16k
+    // after that shows up at $4000 for the matching program bank, so
+    // ROM offset = address + bank * $4000 in both cases and we can
+    // decode every bank up front.
+    for (u32 addr = 0; addr < ROM_SIZE; addr += 2) {
+        decoded *d = &rom_code[addr >> 1];
+        *d = instr_table[(rom[addr] << 8) | rom[addr + 1]];
+
+        if (d->len == 4) {
+            if ((addr + 2) % 0x4000 == 0) {
+                // Operand word would be in the next bank over (or in
+                // RAM), which depends on what's mapped at runtime, so
+                // leave this one to the slow path.
+                d->fn = NULL;
+            } else {
+                d->imm = (rom[addr + 2] << 8) | rom[addr + 3];
+            }
+        }
+    }
+
+    // Now look for arithmetic + conditional jump pairs to fuse.
+    for (u32 addr = 0; addr < ROM_SIZE; addr += 2) {
+        decoded *d = &rom_code[addr >> 1];
+        u32 next = addr + d->len;
+
+        // both have to be in the same 16k (what comes after the end of
+        // one isn't necessarily the next one along)
+        if (!d->fn || !(d->instr & 0x8000) || next % 0x4000 == 0) continue;
+
+        u8 op = (d->instr >> 10) & 0x1f;
+        int reg_src = d->fn == alu_handlers[op][0];
+        if (!fused_handlers[op][0] || d->sets_bank || d->x == 15) continue;
+        if (!reg_src && d->fn != alu_handlers[op][1]) continue;
+
+        const decoded *j = &rom_code[next >> 1];
+        u8 cond = (j->instr >> 10) & 0xf;
+        if (!j->fn || (j->instr & 0xc000) != 0x4000 || cond < 1 || cond > 6) continue;
+
+        d->fn = fused_handlers[op][reg_src ? 0 : 1];
+    }
+}
+
+/*
+ * JIT (--jit)
+ *
+ * Counts how many times each basic block (keyed on where it lives in
+ * ROM or RAM, so (pbr, pc) for the banked areas) gets started, and once
+ * one gets hot, compiles it to x86-64. Simple arithmetic and the jump
+ * at the end of the block are done natively; everything else becomes a
+ * call to the regular instruction handler with pc set up beforehand.
+ *
+ * A block ends at any jump/return, at anything that changes interrupt
+ * or run state (ei, di, reti, halt, stop, bad opcodes), after anything
+ * that might write pc or pbr, and at bank/region edges. Stores can bail
+ * out of a block early too: store_byte sets jit_exit when it touches
+ * hardware registers or overwrites RAM that's been compiled, and the
+ * block checks that after every store. So the main loop still gets to
+ * look at interrupts and so on at least once per block.
+ *
+ * Code memory is only ever handed out bump-style; when it fills up (or
+ * code in RAM is overwritten) blocks are just forgotten, and the whole
+ * buffer is reset at the next safe point.
+ */
+
+int use_jit = 0;
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_SUPPORTED
+#endif
+
+// compile a block once it's been started this many times
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 32
+#endif
+// most instructions per block
+#define JIT_MAX_BLOCK 32
+
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#define JIT_DECODED_SIZE 65536
+
+// heat value meaning 'tried, couldn't compile'
+#define JIT_COLD 255
+
+#ifdef JIT_SUPPORTED
+#include <stddef.h>
+#include <sys/mman.h>
+
+typedef int (*jit_fn)(interp *I);
+
+// A compiled block. lead is how many cycles in its last instruction
+// starts, so we know whether the whole thing fits before a deadline.
+typedef struct jit_block {
+    jit_fn fn;
+    u16 lead;
+} jit_block;
+
+u8 *jit_code;
+u8 *jit_ptr;
+int jit_overflow;
+
+// decoded copies of instructions in RAM (which can change under us);
+// only jit_flush gives these back
+decoded jit_decoded[JIT_DECODED_SIZE];
+int n_jit_decoded;
+
+// compiled blocks and how often each start address has been run,
+// indexed by ROM or RAM word offset. RAM ones are also kept apart by
+// which window ([0] $8000, [1] $a000) they were run from: with pbr 0
+// both windows show the same RAM, and a block has its pcs built in.
+jit_block rom_blocks[ROM_SIZE / 2];
+u8 rom_heat[ROM_SIZE / 2];
+jit_block ram_blocks[2][RAM_SIZE / 2];
+u8 ram_heat[2][RAM_SIZE / 2];
+// length in bytes of the RAM block starting at each offset
+u8 ram_block_len[2][RAM_SIZE / 2];
+// which 256-byte pages of RAM have compiled code in them
+u8 ram_code_pages[RAM_SIZE / 256];
+int jit_pending_flush;
+
+void jit_flush() {
+    jit_ptr = jit_code;
+    n_jit_decoded = 0;
+    memset(rom_blocks, 0, sizeof(rom_blocks));
+    memset(rom_heat, 0, sizeof(rom_heat));
+    memset(ram_blocks, 0, sizeof(ram_blocks));
+    memset(ram_heat, 0, sizeof(ram_heat));
+    memset(ram_code_pages, 0, sizeof(ram_code_pages));
+    jit_pending_flush = 0;
+}
+
+int init_jit() {
+    jit_code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit_code == MAP_FAILED) {
+        fprintf(stderr, "Couldn't get executable memory for the JIT.\n");
+        return 0;
+    }
+    jit_flush();
+    return 1;
+}
+
+void jit_ram_written(interp *I, u16 offset) {
+    // Forget about any block that covers this byte of RAM.
+    if (!ram_code_pages[offset >> 8]) return;
+
+    int first = offset - JIT_MAX_BLOCK * 4;
+    if (first < 0) first = 0;
+
+    for (int start = first & ~1; start <= offset; start += 2) {
+        for (int w = 0; w < 2; w++) {
+            if (ram_blocks[w][start >> 1].fn && start + ram_block_len[w][start >> 1] > offset) {
+                ram_blocks[w][start >> 1].fn = NULL;
+                ram_heat[w][start >> 1] = 0;
+            }
+        }
+    }
+
+    // in case the block we're running just overwrote itself
+    I->jit_exit = 1;
+}
+
+/* x86-64 code emission */
+
+static void emit8(u8 b) {
+    if (jit_ptr >= jit_code + JIT_CODE_SIZE) {
+        jit_overflow = 1;
+        return;
+    }
+    *jit_ptr++ = b;
+}
+
+static void emit16(u16 v) {
+    emit8(v & 0xff);
+    emit8(v >> 8);
+}
+
+static void emit32(u32 v) {
+    emit16(v & 0xffff);
+    emit16(v >> 16);
+}
+
+static void emit64(u64 v) {
+    emit32(v & 0xffffffff);
+    emit32(v >> 32);
+}
+
+// ModRM + displacement for [rbx + disp]
+static void emit_rbx_mem(u8 reg, int disp) {
+    if (disp < 128) {
+        emit8(0x43 | (reg << 3));
+        emit8(disp);
+    } else {
+        emit8(0x83 | (reg << 3));
+        emit32(disp);
+    }
+}
+
+#define REG_OFFSET(r) ((int)offsetof(interp, regs) + (r) * 2)
+#define PC_OFFSET REG_OFFSET(REG_PC)
+#define FLAGS_OFFSET ((int)offsetof(interp, flags))
+#define EXIT_OFFSET ((int)offsetof(interp, jit_exit))
+#define CYCLES_OFFSET ((int)offsetof(interp, cycles))
+
+static void emit_set_pc(u16 pc) {
+    // mov word [rbx + pc], imm16
+    emit8(0x66); emit8(0xc7); emit_rbx_mem(0, PC_OFFSET); emit16(pc);
+}
+
+static void emit_add_cycles(int n_cycles) {
+    // add qword [rbx + cycles], n_cycles
+    emit8(0x48); emit8(0x81); emit_rbx_mem(0, CYCLES_OFFSET); emit32(n_cycles);
+}
+
+static void emit_exit(int n_instrs, int n_cycles) {
+    emit_add_cycles(n_cycles);
+    // mov eax, n; pop rbx; ret
+    emit8(0xb8); emit32(n_instrs);
+    emit8(0x5b);
+    emit8(0xc3);
+}
+
+static void emit_call(instr_handler fn, const decoded *d) {
+    // mov rdi, rbx; mov rsi, d; mov rax, fn; call rax
+    emit8(0x48); emit8(0x89); emit8(0xdf);
+    emit8(0x48); emit8(0xbe); emit64((u64)(uintptr_t)d);
+    emit8(0x48); emit8(0xb8); emit64((u64)(uintptr_t)fn);
+    emit8(0xff); emit8(0xd0);
+}
+
+static void emit_exit_check(int n_instrs, int n_cycles) {
+    // cmp byte [rbx + jit_exit], 0; je skip
+    emit8(0x80); emit_rbx_mem(7, EXIT_OFFSET); emit8(0x00);
+    emit8(0x74); emit8(0);
+    u8 *skip = jit_ptr;
+    // mov byte [rbx + jit_exit], 0; then leave
+    emit8(0xc6); emit_rbx_mem(0, EXIT_OFFSET); emit8(0x00);
+    emit_exit(n_instrs, n_cycles);
+    if (!jit_overflow) skip[-1] = jit_ptr - skip;
+}
+
+// Try to do an arithmetic instruction natively. Only the ones whose
+// carry/zero flags line up exactly with what x86 gives us for a 16-bit
+// operation, and nothing that writes pc or a bank register.
+static int emit_alu(const decoded *d) {
+    u8 op = (d->instr >> 10) & 0x1f;
+    int reg_src = d->fn == alu_handlers[op][0];
+
+    if (d->sets_bank || d->x == 15 || (reg_src && d->y == 15)) return 0;
+    if (!alu_handlers[op][0] || (!reg_src && d->fn != alu_handlers[op][1])) return 0;
+
+    u8 opcode;
+    switch (op) {
+        case 0x00: opcode = 0x85; break;    // mov (test for flags)
+        case 0x01: opcode = 0x01; break;    // add
+        case 0x02: opcode = 0x29; break;    // sub
+        case 0x09: opcode = 0x21; break;    // and
+        case 0x0a: opcode = 0x09; break;    // or
+        case 0x0b: opcode = 0x31; break;    // xor
+        case 0x0e: opcode = 0x01; break;    // inc (add 1)
+        case 0x0f: opcode = 0x29; break;    // dec (sub 1)
+        case 0x1e: opcode = 0x39; break;    // cmp
+        default: return 0;
+    }
+
+    // movzx eax, word [dest]
+    emit8(0x0f); emit8(0xb7); emit_rbx_mem(0, REG_OFFSET(d->x));
+
+    if (op == 0x0e || op == 0x0f) {
+        // mov ecx, 1
+        emit8(0xb9); emit32(1);
+    } else if (reg_src) {
+        // movzx ecx, word [src]
+        emit8(0x0f); emit8(0xb7); emit_rbx_mem(1, REG_OFFSET(d->y));
+    } else {
+        // mov ecx, imm
+        emit8(0xb9); emit32(d->imm);
+    }
+
+    if (op == 0x00) {
+        // test cx, cx; mov eax, ecx
+        emit8(0x66); emit8(0x85); emit8(0xc9);
+        emit8(0x89); emit8(0xc8);
+    } else {
+        // <op> ax, cx
+        emit8(0x66); emit8(opcode); emit8(0xc8);
+    }
+
+    // setc cl; setz dl
+    emit8(0x0f); emit8(0x92); emit8(0xc1);
+    emit8(0x0f); emit8(0x94); emit8(0xc2);
+
+    if (op != 0x1e) {
+        // mov word [dest], ax
+        emit8(0x66); emit8(0x89); emit_rbx_mem(0, REG_OFFSET(d->x));
+    }
+
+    // flags = (flags & ~(C|Z)) | cl << 3 | dl << 4
+    emit8(0xc0); emit8(0xe1); emit8(3);
+    emit8(0xc0); emit8(0xe2); emit8(4);
+    emit8(0x08); emit8(0xd1);
+    emit8(0x66); emit8(0x81); emit_rbx_mem(4, FLAGS_OFFSET);
+    emit16(~(CARRY_FLAG | ZERO_FLAG) & 0xffff);
+    emit8(0x08); emit_rbx_mem(1, FLAGS_OFFSET);
+
+    return 1;
+}
+
+// Conditional (or not) jump at the end of a block, done natively.
+static int emit_jump(const decoded *d, u16 pc) {
+    u8 op = (d->instr >> 10) & 0xf;
+    if (op > 6 || d->fn == jump_unknown) return 0;
+
+    u16 taken = (d->instr & 0x03ff) ? pc + d->imm : d->imm;
+    u16 not_taken = pc + d->len;
+
+    if (op == 0) {
+        emit_set_pc(taken);
+        return 1;
+    }
+
+    u16 mask = (op <= 2) ? ZERO_FLAG : (op <= 4) ? CARRY_FLAG : (ZERO_FLAG | CARRY_FLAG);
+    // jz/jc/jle jump when a flag is set; jnz/jnc/jgt when it isn't
+    int jump_if_set = (op == 1 || op == 3 || op == 5);
+
+    // mov eax, taken; mov ecx, not_taken
+    emit8(0xb8); emit32(taken);
+    emit8(0xb9); emit32(not_taken);
+    // test word [rbx + flags], mask
+    emit8(0x66); emit8(0xf7); emit_rbx_mem(0, FLAGS_OFFSET); emit16(mask);
+    // cmovz / cmovnz eax, ecx
+    emit8(0x0f); emit8(jump_if_set ? 0x44 : 0x45); emit8(0xc1);
+    // mov word [rbx + pc], ax
+    emit8(0x66); emit8(0x89); emit_rbx_mem(0, PC_OFFSET);
+    return 1;
+}
+
+// what do_instr does after anything with sets_bank
+static void jit_update_banks(interp *I, const decoded *d) {
+    update_banks(I);
+}
+
+// Native code reads and writes carry and zero in flags directly, so
+// ALU instructions that went through their handler need their flags
+// worked out straight away.
+static void jit_sync_flags(interp *I, const decoded *d) {
+    sync_flags(I);
+}
+
+// Does this instruction have to be the last one in its block?
+static int ends_block(const decoded *d) {
+    u16 instr = d->instr;
+
+    if ((instr & 0xc000) == 0x4000) return 1;   // jumps
+    if (d->fn == op_nop || d->fn == op_push) return 0;
+    if (d->fn == op_pop) return d->x == 13 || d->x == 15;
+    if (d->fn == op_swap) return d->x == 13 || d->x == 15 || d->y == 13 || d->y == 15;
+    if ((instr & 0xf000) == 0x0000) return 1;   // ret, halt, ei, etc.
+
+    if (instr & 0x8000) {
+        if (d->fn == alu_bad_src || d->fn == alu_unused_op) return 1;
+        return d->x == 13 || d->x == 15;
+    }
+
+    if ((instr & 0xe000) == 0x2000) {
+        if (d->fn == loadstore_bad_mode) return 1;
+        // loads can write pc/pbr
+        return !(instr & 0x1000) && (d->x == 13 || d->x == 15);
+    }
+
+    return 1;
+}
+
+static int is_store(const decoded *d) {
+    return d->fn == op_push || ((d->instr & 0xf000) == 0x3000);
+}
+
+// Decoded instruction at pc (with the given bank), or NULL if it's not
+// in the same ROM/RAM region as the start of the block.
+static const decoded *jit_fetch(interp *I, int in_ram, u32 base, u16 region_end, u16 pc) {
+    if (pc + 2 > region_end) return NULL;
+
+    if (!in_ram) {
+        const decoded *d = &rom_code[(base + pc) >> 1];
+        if (!d->fn) return NULL;
+        if (d->fn == instr_table[d->instr].fn) return d;
+
+        // fused pair: the block does the jump itself, so just the first half
+        if (n_jit_decoded >= JIT_DECODED_SIZE) {
+            jit_overflow = 1;
+            return NULL;
+        }
+        decoded *copy = &jit_decoded[n_jit_decoded++];
+        *copy = *d;
+        copy->fn = instr_table[d->instr].fn;
+        return copy;
+    }
+
+    u32 offset = base + pc;
+    if (offset + 2 > RAM_SIZE) return NULL;
+    // out of room for copies: same as running out of code buffer, so
+    // the next compile flushes everything and tries again
+    if (n_jit_decoded >= JIT_DECODED_SIZE) {
+        jit_overflow = 1;
+        return NULL;
+    }
+
+    decoded *d = &jit_decoded[n_jit_decoded];
+    *d = instr_table[(I->mem[offset] << 8) | I->mem[offset + 1]];
+    if (d->len == 4) {
+        if (pc + 4 > region_end || offset + 4 > RAM_SIZE) return NULL;
+        d->imm = (I->mem[offset + 2] << 8) | I->mem[offset + 3];
+    }
+    n_jit_decoded++;
+    return d;
+}
+
+jit_block jit_compile(interp *I, int in_ram, u32 base, u16 region_end, u16 start_pc) {
+    jit_block block = { NULL, 0 };
+    u8 *start = jit_ptr;
+    u16 pc = start_pc;
+    int n = 0;
+    int cycles = 0;
+    // how many of those are already in I->cycles
+    int flushed = 0;
+    int done = 0;
+
+    jit_overflow = 0;
+
+    // push rbx; mov rbx, rdi
+    emit8(0x53);
+    emit8(0x48); emit8(0x89); emit8(0xfb);
+
+    while (n < JIT_MAX_BLOCK && !done) {
+        const decoded *d = jit_fetch(I, in_ram, base, region_end, pc);
+        if (!d) break;
+
+        block.lead = cycles;
+        n++;
+        cycles += d->cycles;
+
+        if ((d->instr & 0x8000) && emit_alu(d)) {
+            pc += d->len;
+            continue;
+        }
+
+        if ((d->instr & 0xc000) == 0x4000 && emit_jump(d, pc)) {
+            emit_exit(n, cycles - flushed);
+            done = 1;
+            break;
+        }
+
+        // loads and stores can get to hardware that looks at the clock
+        // (the timer), so bring I->cycles up to the start of this
+        // instruction first, like do_instr would have it
+        if ((d->instr & 0xe000) == 0x2000 && block.lead > flushed) {
+            emit_add_cycles(block.lead - flushed);
+            flushed = block.lead;
+        }
+        emit_set_pc(pc);
+        emit_call(d->fn, d);
+        if (d->instr & 0x8000) {
+            emit_call(jit_sync_flags, d);
+        }
+        if (d->sets_bank) {
+            emit_call(jit_update_banks, d);
+        }
+        pc += d->len;
+
+        if (ends_block(d)) {
+            // the handler's already set pc
+            emit_exit(n, cycles - flushed);
+            done = 1;
+        } else if (is_store(d)) {
+            emit_exit_check(n, cycles - flushed);
+        }
+    }
+
+    if (!done) {
+        emit_set_pc(pc);
+        emit_exit(n, cycles - flushed);
+    }
+
+    if (jit_overflow) {
+        jit_pending_flush = 1;
+        return block;
+    }
+
+    if (n == 0) {
+        jit_ptr = start;
+        return block;
+    }
+
+    if (in_ram) {
+        u32 first = base + start_pc;
+        u32 last = base + pc + 1;
+        ram_block_len[start_pc >= 0xa000][first >> 1] = pc - start_pc;
+        for (u32 page = first >> 8; page <= (last >> 8) && page < RAM_SIZE / 256; page++) {
+            ram_code_pages[page] = 1;
+        }
+    }
+
+    block.fn = (jit_fn)start;
+    return block;
+}
+
+int jit_step(interp *I, u64 limit) {
+    // Work out where pc is: ROM or RAM, which offset, and where the
+    // region it's in ends (so blocks don't run across bank edges).
+    u16 pc = I->regs[REG_PC];
+    int in_ram;
+    u32 base;
+    u16 region_end;
+    jit_block *slot;
+    u8 *heat;
+
+    if (pc & 1) {
+        do_instr(I);
+        return 1;
+    } else if (pc < 0x4000) {
+        in_ram = 0; base = 0; region_end = 0x4000;
+    } else if (pc < 0x8000) {
+        in_ram = 0; base = I->regs[REG_PBR] * 0x4000; region_end = 0x8000;
+    } else if (pc < 0xa000) {
+        in_ram = 1; base = -0x8000; region_end = 0xa000;
+    } else if (pc < 0xc000) {
+        in_ram = 1; region_end = 0xc000;
+        base = I->regs[REG_PBR] * 0x2000 - 0xa000;
+    } else {
+        do_instr(I);
+        return 1;
+    }
+
+    u32 offset = base + pc;
+    if (offset >= (in_ram ? RAM_SIZE : ROM_SIZE)) {
+        do_instr(I);
+        return 1;
+    }
+
+    if (in_ram) {
+        int window = pc >= 0xa000;
+        slot = &ram_blocks[window][offset >> 1];
+        heat = &ram_heat[window][offset >> 1];
+    } else {
+        slot = &rom_blocks[offset >> 1];
+        heat = &rom_heat[offset >> 1];
+    }
+
+    if (!slot->fn) {
+        if (*heat != JIT_COLD && ++*heat >= JIT_THRESHOLD) {
+            if (jit_pending_flush) {
+                jit_flush();
+            }
+            *slot = jit_compile(I, in_ram, base, region_end, pc);
+            if (!slot->fn) *heat = jit_pending_flush ? 0 : JIT_COLD;
+        }
+        if (!slot->fn) {
+            do_instr(I);
+            return 1;
+        }
+    }
+
+    // The interpreter would stop at the first instruction that starts
+    // at or after limit, so only run the block if all of it would've
+    // run anyway. Otherwise the last few instructions before an
+    // interrupt go one at a time.
+    if (I->cycles + slot->lead >= limit) {
+        do_instr(I);
+        return 1;
+    }
+
+    sync_flags(I);
+    return slot->fn(I);
+}
+
 #else
-        // crash :(
-        I->flags &= ~RUN_FLAG;
-        I->flags |= CRASH_FLAG;
+
+int init_jit() {
+    fprintf(stderr, "The JIT only works on x86-64 for now.\n");
+    return 0;
+}
+
+void jit_ram_written(interp *I, u16 offset) {
+}
+
+int jit_step(interp *I, u64 limit) {
+    do_instr(I);
+    return 1;
+}
+
 #endif
+
+int cpu_step(interp *I, u64 limit) {
+    // Run at least one instruction, and don't start any at or after
+    // cycle limit except that first one. Returns how many we ran.
+    if (use_jit) {
+        return jit_step(I, limit);
+    }
+    do_instr(I);
+    return 1;
+}
+
+long run_slice(interp *I, u64 until) {
+    // Run the CPU until the cycle counter reaches until, without going
+    // back out to SDL. Comes back early if the CPU halts or stops,
+    // since then the outside world has to happen before anything else
+    // can. Returns how many instructions we ran.
+    //
+    // Guest-visible stuff still happens between every instruction,
+    // same as when main() did it: an ei/reti only takes effect after
+    // the next instruction, and if an interrupt's been waiting for
+    // that, the slice ends there so the main loop can take it. Both
+    // only matter when INTERRUPT_ENABLE_NEXT is set, so the common
+    // case is one test of the flags.
+    //
+    // The first few instructions of a slice go one at a time, to check
+    // whether we're going around a loop that gets back to exactly
+    // where it started (same registers and flags, nothing stored). If
+    // so, nothing can change until an interrupt, and every lap is the
+    // same length, so we can skip all the laps that fit before until
+    // and only run the last bit for real. (Reading the timer's count
+    // counts as changing something, since it changes by itself.)
+    //
+    // The slice can end sooner than until if something the program
+    // does sets up an event before then (see start_timer), so this
+    // goes by I->cycle_limit rather than until.
+    long n = 0;
+    int probing = idle_skip;
+    u16 start_regs[16];
+    u16 start_flags = 0;
+    u64 start_cycles = I->cycles;
+    u32 start_stores = I->stores;
+    u32 start_timer_reads = I->timer_reads;
+
+    if (probing) {
+        memcpy(start_regs, I->regs, sizeof(start_regs));
+        start_flags = cur_flags(I);
+    }
+
+    I->cycle_limit = until;
+
+    while (I->cycles < I->cycle_limit) {
+        if ((I->flags & (RUN_FLAG | WAIT_FLAG | INTERRUPT_ENABLE_NEXT)) != RUN_FLAG) {
+            if (I->flags & INTERRUPT_ENABLE_NEXT) {
+                I->flags &= ~INTERRUPT_ENABLE_NEXT;
+                I->flags |= INTERRUPT_ENABLE;
+                if (I->irq_pending & I->irq_enabled) {
+                    break;
+                }
+            }
+            if (!(I->flags & RUN_FLAG) || (I->flags & WAIT_FLAG)) {
+                break;
+            }
+        }
+        if (!probing) {
+            n += cpu_step(I, I->cycle_limit);
+            continue;
+        }
+
+        do_instr(I);
+        n++;
+        if (I->regs[REG_PC] == start_regs[REG_PC]) {
+            probing = 0;
+            if (cur_flags(I) == start_flags && I->stores == start_stores
+                    && I->timer_reads == start_timer_reads
+                    && !memcmp(start_regs, I->regs, sizeof(start_regs))
+                    && I->cycles < I->cycle_limit) {
+                u64 lap = I->cycles - start_cycles;
+                I->cycles += (I->cycle_limit - I->cycles) / lap * lap;
+            }
+        } else if (n >= IDLE_LOOP_MAX) {
+            probing = 0;
+        }
+    }
+
+    return n;
+}
+
+void raise_irq(interp *I, u8 irq) {
+    // Something happened; the program hears about it (if it wants to)
+    // the next time service_interrupts gets a look in.
+    I->irq_pending |= irq;
+}
+
+void service_interrupts(interp *I) {
+    // Called between slices. Take the most important interrupt that's
+    // pending and enabled, if the CPU's taking interrupts at all;
+    // the rest wait (the reti will end the slice, and we'll be back).
+    u8 ready = I->irq_pending & I->irq_enabled;
+    if (!ready || !(I->flags & INTERRUPT_ENABLE)) {
+        return;
+    }
+    if (ready & IRQ_VBLANK) {
+        I->irq_pending &= ~IRQ_VBLANK;
+        interrupt(I, VBLANK_INTERRUPT);
+    } else if (ready & IRQ_HBLANK) {
+        I->irq_pending &= ~IRQ_HBLANK;
+        interrupt(I, HBLANK_INTERRUPT);
+    } else if (ready & IRQ_TIMER) {
+        I->irq_pending &= ~IRQ_TIMER;
+        interrupt(I, TIMER_INTERRUPT);
+    } else if (ready & IRQ_DMA) {
+        I->irq_pending &= ~IRQ_DMA;
+        interrupt(I, DMA_INTERRUPT);
     } else {
-        I->pc += pc_increment;
+        // A key that went straight into last_key is already there;
+        // otherwise take the next one from the FIFO. (Stays pending
+        // if there are more keys after this one.)
+        if (I->key_irq_owed) {
+            I->key_irq_owed = 0;
+            if (!I->key_count) {
+                I->irq_pending &= ~IRQ_KEY;
+            }
+        } else {
+            next_key(I);
+        }
+        interrupt(I, KEYBOARD_INTERRUPT);
     }
-
-    /*if (instr != 0x01 && (instr & 0xfc00) != 0x4000) {
-        printf("Instr: $%04X\n", instr);
-        printf("Reg: a: %04X b: %04X c: %04X d: %04X\n", I->a, I->b, I->c, I->d);
-        printf("     e: %04X f: %04X g: %04X h: %04X\n", I->e, I->f, I->g, I->h);
-        printf("     i: %04X j: %04X k: %04X l: %04X\n", I->i, I->j, I->k, I->l);
-        printf("     m: %04X n: %04X SP %04X PC %04X\n", I->dbr, I->pbr, I->sp, I->pc);
-    }*/
 }
 
 int interrupt(interp *I, u16 addr) {
@@ -1090,11 +3206,12 @@ int interrupt(interp *I, u16 addr) {
         return 0;
     }
     //printf("Interrupted... [%d]\n");
-    I->sp -= 2;
-    store_word(I, I->sp, I->pc);
+    I->regs[REG_SP] -= 2;
+    store_word(I, I->regs[REG_SP], I->regs[REG_PC]);
     I->flags &= ~INTERRUPT_ENABLE;
     I->flags &= ~WAIT_FLAG;
-    I->pc = addr;
+    I->regs[REG_PC] = addr;
+    I->cycles += CYC_INTERRUPT;
     return 1;
 }
 
@@ -1102,14 +3219,6 @@ int init_draw() {
     window = NULL;
     screen = NULL;
 
-    if (widescreen) {
-        SCRW = 240;
-        SCRH = 144;
-    } else {
-        SCRW = 240;
-        SCRH = 176;
-    }
-
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         fprintf(stderr, "Failed to initialize SDL. :(\n");
         return 0;
@@ -1138,7 +3247,7 @@ int init_draw() {
     }
 
     texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
-                                SDL_TEXTUREACCESS_TARGET, SCRW, SCRH);
+                                SDL_TEXTUREACCESS_STREAMING, SCRW, SCRH);
 
     if (!texture) {
         fprintf(stderr, "Failed to create texture: %s\n", SDL_GetError());
@@ -1152,7 +3261,7 @@ void handle_keydown(interp *I, SDL_KeyboardEvent key) {
     const u8 SHIFT = 1 << 6;
     const u8 CTRL = 1 << 7;
     u8 keycode = 0;
-    int do_interrupt = 1;
+    int known_key = 1;
     // bit 7 = control
     // bit 6 = shift
     // this leaves 64 unique characters
@@ -1261,7 +3370,7 @@ void handle_keydown(interp *I, SDL_KeyboardEvent key) {
             break;
         default:
             //printf("Oh no unhandled key %c [%d]\n", key.keysym.sym, key.keysym.sym);
-            do_interrupt = 0;
+            known_key = 0;
     }
     SDL_Keymod mods = SDL_GetModState();
 
@@ -1273,17 +3382,30 @@ void handle_keydown(interp *I, SDL_KeyboardEvent key) {
         keycode |= CTRL;
     }
 
-    I->last_key = keycode;
-
-    if (do_interrupt && !interrupt(I, KEYBOARD_INTERRUPT)) {
-        backup_key = keycode;
-    } else {
-        backup_key = 0xff;
+    if (!known_key) {
+        return;
+    }
+    // Nothing waiting, and the program's seen the last key (or isn't
+    // taking keyboard interrupts, in which case it just gets the
+    // newest key, like before there was a FIFO): $ff02 shows it now.
+    if (!I->key_count && (!I->key_unread || !(I->irq_enabled & IRQ_KEY))) {
+        I->last_key = keycode;
+        I->key_unread = 1;
+        I->key_irq_owed = 1;
+        raise_irq(I, IRQ_KEY);
+        return;
     }
+    if (I->key_count == KEY_FIFO_SIZE) {
+        I->key_overflow = 1;
+        return;
+    }
+    I->key_fifo[(I->key_head + I->key_count) % KEY_FIFO_SIZE] = keycode;
+    I->key_count++;
+    raise_irq(I, IRQ_KEY);
 }
 
 u32 get_palette_color(u16 color) {
-    // Convert 15-bit color to 24-bit color
+    // Convert 15-bit color to the texture's RGBA8888
     u32 r = (color >> 10) & 0x1f;
     u32 g = (color >>  5) & 0x1f;
     u32 b = (color >>  0) & 0x1f;
@@ -1292,111 +3414,338 @@ u32 get_palette_color(u16 color) {
     g = g * 255 / 31;
     b = b * 255 / 31;
 
-    return (r << 16) | (g << 8) | b;
+    return (r << 24) | (g << 16) | (b << 8) | 0xff;
+}
+
+void update_palette(ppu *p) {
+    // Convert any colors that got written since last time.
+    for (int i = 0; i < N_PALETTES * 2 * N_COLORS; i++) {
+        if (p->palette_dirty[i]) {
+            u16 color = (p->palette_data[i * 2] << 8) | p->palette_data[i * 2 + 1];
+            p->palette_colors[i / N_COLORS][i % N_COLORS] = get_palette_color(color);
+            p->palette_dirty[i] = 0;
+        }
+    }
+    p->palette_seen = p->palette_gen;
+}
+
+static void decode_pattern_row(ppu *p, u16 r) {
+    // SPRITE_BYTES / SPRITE_HEIGHT = # of bytes per sprite row,
+    // each with 8 / N_PIXEL_BITS pixels packed into it, high bits
+    // first
+    u8 *bytes = &p->pattern_table[r * (SPRITE_BYTES / SPRITE_HEIGHT)];
+    for (int i = 0; i < SPRITE_WIDTH; i++) {
+        u8 pixel_offset = 8 - (i % (8 / N_PIXEL_BITS) + 1) * N_PIXEL_BITS;
+        u8 pixel = (bytes[i / (8 / N_PIXEL_BITS)] >> pixel_offset) & ~(~0 << N_PIXEL_BITS);
+        p->pattern_rows[r][0][i] = pixel;
+        p->pattern_rows[r][1][SPRITE_WIDTH - 1 - i] = pixel;
+    }
+    p->pattern_dirty[r] = 0;
 }
 
-void scanline(interp *I, int line_num) {
-    u32 tile_palettes[N_PALETTES][N_COLORS];
-    u32 sprite_palettes[N_PALETTES][N_COLORS];
+static const u8 *pattern_row(ppu *p, u16 idx, u8 row, int horiz_flip) {
+    // The decoded pixels for one row of tile idx. Rows past the end of
+    // the tile carry on into the next one, like the pattern table does
+    // (16px sprites rely on this).
+    u16 r = (idx * SPRITE_HEIGHT + row) % (512 * SPRITE_HEIGHT);
+
+    if (p->pattern_dirty[r]) {
+        decode_pattern_row(p, r);
+    }
+
+    return p->pattern_rows[r][horiz_flip];
+}
 
-    u32 line_colors[SCRW];
-    u8  line_priorities[SCRW];
+void bin_sprites(ppu *p) {
+    // Sort the sprites into the lines they show up on. A sprite's on
+    // a line if scanline would pick a row of it there: the first 8 or
+    // 16 rows after y normally, and with vertical flip the 8 rows
+    // after y plus (for 16px ones) the 8 before it.
+    for (int line = 0; line < MAX_SCRH; line++) {
+        p->line_sprite_count[line] = 0;
+    }
 
-    for (int pal = 0; pal < N_PALETTES; pal++) {
-        for (int i = 0; i < N_COLORS; i++) {
-            u8 pal_color_hi = I->ppu->palette_data[pal * N_COLORS * 2 + i * 2];
-            u8 pal_color_lo = I->ppu->palette_data[pal * N_COLORS * 2 + i * 2 + 1];
-            u16 pal_color = (pal_color_hi << 8) | pal_color_lo;
-            tile_palettes[pal][i] = get_palette_color(pal_color);
+    for (int spr = 0; spr < 256; spr++) {
+        u8 info = p->oam[spr * 4];
+        u8 y = p->oam[spr * 4 + 3] - p->sprite_v_offset;
+        u8 sprite_size = (info & 0x2) ? 16 : 8;
+
+        for (int k = -8; k < 16; k++) {
+            u8 sprite_row = k;
+            if (info & 0x4) sprite_row = 7 - sprite_row;
+            u8 line = y + k;
+            if (sprite_row < sprite_size && line < MAX_SCRH) {
+                p->line_sprites[line][p->line_sprite_count[line]++] = spr;
+            }
         }
     }
 
-    for (int pal = 0; pal < N_PALETTES; pal++) {
-        for (int i = 0; i < N_COLORS; i++) {
-            u8 pal_color_hi = I->ppu->palette_data[128 + pal * N_COLORS * 2 + i * 2];
-            u8 pal_color_lo = I->ppu->palette_data[128 + pal * N_COLORS * 2 + i * 2 + 1];
-            u16 pal_color = (pal_color_hi << 8) | pal_color_lo;
-            sprite_palettes[pal][i] = get_palette_color(pal_color);
+    p->sprites_dirty = 0;
+}
+
+/*
+ * Compositing
+ *
+ * scanline first draws each layer into its own 256-pixel line (so
+ * scrolling just wraps), then composite_line merges the three and
+ * looks up the colors. In the layer lines, col is the index into
+ * palette_colors (tile palettes first, so sprites' are 64 and up) and
+ * pri is the priority that pixel would have on screen. A tile pixel
+ * with col 0 is see-through; a sprite pixel with pri 0 isn't there.
+ *
+ * The merge goes: background color, then the background layer if
+ * the pixel isn't see-through, then the sprite layer if its priority
+ * is higher, then the foreground layer if its priority is higher.
+ * (The sprite line already has the frontmost sprite at each pixel.)
+ */
+
+typedef struct line_layers {
+    u8 bg_col[256];
+    u8 bg_pri[256];
+    u8 spr_col[256];
+    u8 spr_pri[256];
+    u8 fg_col[256];
+    u8 fg_pri[256];
+} line_layers;
+
+typedef void (*composite_fn)(const line_layers *L, const u32 *colors,
+                             u32 *out, int width);
+
+void composite_scalar(const line_layers *L, const u32 *colors,
+                      u32 *out, int width) {
+    for (int x = 0; x < width; x++) {
+        u8 col = 0;
+        u8 pri = 0;
+        if (L->bg_col[x]) {
+            col = L->bg_col[x];
+            pri = L->bg_pri[x];
+        }
+        if (L->spr_pri[x] > pri) {
+            col = L->spr_col[x];
+            pri = L->spr_pri[x];
+        }
+        if (L->fg_col[x] && L->fg_pri[x] > pri) {
+            col = L->fg_col[x];
         }
+        out[x] = colors[col];
+    }
+}
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+// (all the priorities are < 128, so signed compares are fine)
+
+void composite_sse2(const line_layers *L, const u32 *colors,
+                    u32 *out, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    u8 cols[256];
+
+    for (int x = 0; x < width; x += 16) {
+        __m128i bg_col = _mm_loadu_si128((const __m128i *)&L->bg_col[x]);
+        __m128i bg_pri = _mm_loadu_si128((const __m128i *)&L->bg_pri[x]);
+        __m128i spr_col = _mm_loadu_si128((const __m128i *)&L->spr_col[x]);
+        __m128i spr_pri = _mm_loadu_si128((const __m128i *)&L->spr_pri[x]);
+        __m128i fg_col = _mm_loadu_si128((const __m128i *)&L->fg_col[x]);
+        __m128i fg_pri = _mm_loadu_si128((const __m128i *)&L->fg_pri[x]);
+
+        // background (col and pri start out as 0)
+        __m128i m = _mm_cmpeq_epi8(bg_col, zero);
+        __m128i col = _mm_andnot_si128(m, bg_col);
+        __m128i pri = _mm_andnot_si128(m, bg_pri);
+
+        // sprites
+        m = _mm_cmpgt_epi8(spr_pri, pri);
+        col = _mm_or_si128(_mm_andnot_si128(m, col), _mm_and_si128(m, spr_col));
+        pri = _mm_or_si128(_mm_andnot_si128(m, pri), _mm_and_si128(m, spr_pri));
+
+        // foreground
+        m = _mm_andnot_si128(_mm_cmpeq_epi8(fg_col, zero), _mm_cmpgt_epi8(fg_pri, pri));
+        col = _mm_or_si128(_mm_andnot_si128(m, col), _mm_and_si128(m, fg_col));
+
+        _mm_storeu_si128((__m128i *)&cols[x], col);
     }
 
-    for (int i = 0; i < SCRW; i++) {
-        // Default background color
-        line_colors[i] = tile_palettes[0][0];
-        line_priorities[i] = 0;
+    // no gathers before AVX2
+    for (int x = 0; x < width; x++) {
+        out[x] = colors[cols[x]];
     }
+}
 
-    // Tiles per row
-    int row_width = 32;
+__attribute__((target("avx2")))
+void composite_avx2(const line_layers *L, const u32 *colors,
+                    u32 *out, int width) {
+    const __m256i zero = _mm256_setzero_si256();
+    u8 cols[256];
 
-    // Back tile layer
-    // Which row of tiles are we drawing?
-    int bg_row_num = (((line_num + I->ppu->bg_v_offset) / SPRITE_HEIGHT) % row_width + row_width) % row_width;
-    // Which row of that row are we drawing? (i.e. y=0-7)
-    u8 bg_tile_row = ((line_num + I->ppu->bg_v_offset) % SPRITE_HEIGHT + SPRITE_HEIGHT) % SPRITE_HEIGHT;
+    for (int x = 0; x < width; x += 32) {
+        __m256i bg_col = _mm256_loadu_si256((const __m256i *)&L->bg_col[x]);
+        __m256i bg_pri = _mm256_loadu_si256((const __m256i *)&L->bg_pri[x]);
+        __m256i spr_col = _mm256_loadu_si256((const __m256i *)&L->spr_col[x]);
+        __m256i spr_pri = _mm256_loadu_si256((const __m256i *)&L->spr_pri[x]);
+        __m256i fg_col = _mm256_loadu_si256((const __m256i *)&L->fg_col[x]);
+        __m256i fg_pri = _mm256_loadu_si256((const __m256i *)&L->fg_pri[x]);
 
-    for (int t = 0; t < row_width; t++) {
-        // Get the bytes that describe our tile
-        u8 info = I->ppu->bg_map_data[bg_row_num * row_width * 2 + t * 2];
-        u16 idx = I->ppu->bg_map_data[bg_row_num * row_width * 2 + t * 2 + 1];
+        __m256i m = _mm256_cmpeq_epi8(bg_col, zero);
+        __m256i col = _mm256_andnot_si256(m, bg_col);
+        __m256i pri = _mm256_andnot_si256(m, bg_pri);
 
-        int horiz_flip = 0, vert_flip = 0;
-        if (info & 0x1) idx += 256;
-        if (info & 0x4) vert_flip = 1;
-        if (info & 0x8) horiz_flip = 1;
+        m = _mm256_cmpgt_epi8(spr_pri, pri);
+        col = _mm256_blendv_epi8(col, spr_col, m);
+        pri = _mm256_blendv_epi8(pri, spr_pri, m);
 
-        u8 palette = (info & 0xe0) >> 5;
+        m = _mm256_andnot_si256(_mm256_cmpeq_epi8(fg_col, zero), _mm256_cmpgt_epi8(fg_pri, pri));
+        col = _mm256_blendv_epi8(col, fg_col, m);
 
-        u8 tile_row = vert_flip ? 7 - bg_tile_row : bg_tile_row;
-
-        // get the appropriate row of the tile (4 bytes)
-        u8 *tile_bytes = &I->ppu->pattern_table[idx * SPRITE_BYTES
-                                                + tile_row * (SPRITE_BYTES / SPRITE_HEIGHT)];
-
-        int x = t * SPRITE_WIDTH - I->ppu->bg_h_offset;
-
-        // SPRITE_BYTES / SPRITE_HEIGHT = # of bytes per sprite row.
-        // so i iterates over each byte of this row of the sprite.
-        for (int i = 0; i < SPRITE_BYTES / SPRITE_HEIGHT; i++) {
-            // 8 / N_PIXEL_BITS = how many pixels are packed into
-            // a byte. so j iterates over each pixel of the current
-            // sprite byte
-            for (int j = 0; j < 8 / N_PIXEL_BITS; j++) {
-                // ~0 = all 1's; ~0 << NPB = all 1's except w/ NPB 0's at the end
-                // ~(~0 << NPB) = all 0's but with NPB 1's at the end
-                u8 mask = ~(~0 << N_PALETTE_BITS);
-                // to mask out priority bits
-                u8 priority_mask = ~(~0 << N_PRIORITY_BITS);
-                // if j = 0, for instance, we want this offset to give us the *high*
-                // bits of the byte
-                u8 pixel_offset = 8 - (j + 1) * N_PIXEL_BITS;
-                u8 coloridx = (tile_bytes[i] >> pixel_offset) & mask;
-
-                u8 priority_val = ((tile_bytes[i] >> pixel_offset) >> N_PALETTE_BITS) & priority_mask;
-
-                u8 pixelx;
-                if (!horiz_flip) {
-                    // calculate our x position. also mod by 256 so we wrap around
-                    pixelx = (x + i * (8 / N_PIXEL_BITS) + j) % 256;
-                } else {
-                    // calculate our x position but do it backwards tile-wise
-                    pixelx = (x + 7 - (i * (8 / N_PIXEL_BITS) + j)) % 256;
-                }
+        _mm256_storeu_si256((__m256i *)&cols[x], col);
+    }
 
-                if (pixelx >= 0 && pixelx < SCRW && coloridx != 0) {
-                    line_colors[pixelx] = tile_palettes[palette][coloridx];
-                    line_priorities[pixelx] = priority_val * 2;
-                }
-            }
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)&cols[x]));
+        _mm256_storeu_si256((__m256i *)&out[x],
+                            _mm256_i32gather_epi32((const int *)colors, idx, 4));
+    }
+    for (; x < width; x++) {
+        out[x] = colors[cols[x]];
+    }
+}
+
+#endif
+
+composite_fn composite_line = composite_scalar;
+
+void pick_compositor(int use_simd) {
+    composite_line = composite_scalar;
+#if defined(__x86_64__)
+    if (use_simd) {
+        composite_line = SDL_HasAVX2() ? composite_avx2 : composite_sse2;
+    }
+#endif
+}
+
+static void draw_cell(ppu *p, int layer, int cell) {
+    // Draw one 8x8 cell of a tilemap into its layer bitmap.
+    const u8 *map_data = layer ? p->fg_map_data : p->bg_map_data;
+
+    // Get the bytes that describe our tile
+    u8 info = map_data[cell * 2];
+    u16 idx = map_data[cell * 2 + 1];
+
+    int horiz_flip = 0, vert_flip = 0;
+    if (info & 0x1) idx += 256;
+    if (info & 0x4) vert_flip = 1;
+    if (info & 0x8) horiz_flip = 1;
+
+    u8 palette = (info & 0xe0) >> 5;
+    // the fg layer's pixels go in front of the bg's
+    u8 base_priority = layer ? 4 : 0;
+
+    int x = cell % 32 * SPRITE_WIDTH;
+    int y = cell / 32 * SPRITE_HEIGHT;
+
+    for (int row = 0; row < SPRITE_HEIGHT; row++) {
+        const u8 *pixels = pattern_row(p, idx, vert_flip ? 7 - row : row, horiz_flip);
+        u8 *cols = &p->layer_col[layer][y + row][x];
+        u8 *pris = &p->layer_pri[layer][y + row][x];
+
+        for (int i = 0; i < SPRITE_WIDTH; i++) {
+            // each pixel out of pattern_row is the priority bit above
+            // the color index
+            u8 coloridx = pixels[i] % N_COLORS;
+
+            cols[i] = coloridx ? palette * N_COLORS + coloridx : 0;
+            pris[i] = base_priority + (pixels[i] / N_COLORS) * 2;
         }
     }
 
-    for (int spr = 0; spr < 256; spr++) {
-        u8 info = I->ppu->oam[spr * 4];
-        u16 idx = I->ppu->oam[spr * 4 + 1];
+    p->cell_dirty[layer][cell] = 0;
+    p->cell_gen[layer][cell] = p->tile_gen[idx];
+}
+
+static void update_cells(ppu *p, int layer, u8 v_offset, int line_num) {
+    // Redraw any cells on this line of a tilemap layer that are out of
+    // date.
+    const u8 *map_data = layer ? p->fg_map_data : p->bg_map_data;
+
+    // (u8, so it wraps around)
+    u8 y = line_num + v_offset;
+
+    int first = y / SPRITE_HEIGHT * 32;
+    for (int cell = first; cell < first + 32; cell++) {
+        u16 idx = map_data[cell * 2 + 1] + ((map_data[cell * 2] & 0x1) ? 256 : 0);
+        if (p->cell_dirty[layer][cell] || p->cell_gen[layer][cell] != p->tile_gen[idx]) {
+            draw_cell(p, layer, cell);
+        }
+    }
+}
+
+static void tile_layer(const ppu *p, int layer, u8 h_offset, u8 v_offset,
+                       int line_num, u8 *cols, u8 *pris) {
+    // Copy one line of a tilemap layer out of its bitmap (which
+    // update_cells has brought up to date).
+    u8 y = line_num + v_offset;
+
+    // x on screen is x + h_offset in the bitmap, wrapping around
+    memcpy(cols, &p->layer_col[layer][y][h_offset], 256 - h_offset);
+    memcpy(cols + 256 - h_offset, &p->layer_col[layer][y][0], h_offset);
+    memcpy(pris, &p->layer_pri[layer][y][h_offset], 256 - h_offset);
+    memcpy(pris + 256 - h_offset, &p->layer_pri[layer][y][0], h_offset);
+}
+
+/*
+ * Drawing a line is in three parts: start_line decides whether it
+ * needs drawing at all, prepare_line brings the caches it uses up to
+ * date, and render_line draws it. render_line only reads the ppu
+ * (once every pattern row is decoded; see flush_lines), so lines that
+ * have been prepared can be rendered at the same time.
+ */
+
+static int start_line(ppu *p, int line_num) {
+    if (line_num == 0) {
+        p->redraw_frame = p->screen_changed;
+        p->screen_changed = 0;
+        p->lines_drawn = 0;
+    }
+    if (!p->redraw_frame && !p->screen_changed) {
+        // same as last frame's
+        return 0;
+    }
+    p->lines_drawn++;
+    return 1;
+}
 
-        u8 x = I->ppu->oam[spr * 4 + 2] - I->ppu->sprite_h_offset;
-        u8 y = I->ppu->oam[spr * 4 + 3] - I->ppu->sprite_v_offset;
+static void prepare_line(ppu *p, int line_num) {
+    if (p->palette_seen != p->palette_gen) {
+        update_palette(p);
+    }
+    if (p->sprites_dirty) {
+        bin_sprites(p);
+    }
+    update_cells(p, 0, p->bg_v_offset, line_num);
+    update_cells(p, 1, p->fg_v_offset, line_num);
+}
+
+static void render_line(ppu *p, int line_num) {
+    line_layers L;
+
+    // Back tile layer
+    tile_layer(p, 0, p->bg_h_offset, p->bg_v_offset,
+               line_num, L.bg_col, L.bg_pri);
+
+    // Sprites, frontmost at each pixel (the first of the highest
+    // priority ones in OAM order)
+    memset(L.spr_col, 0, sizeof(L.spr_col));
+    memset(L.spr_pri, 0, sizeof(L.spr_pri));
+
+    for (int n = 0; n < p->line_sprite_count[line_num]; n++) {
+        int spr = p->line_sprites[line_num][n];
+        u8 info = p->oam[spr * 4];
+        u16 idx = p->oam[spr * 4 + 1];
+
+        u8 x = p->oam[spr * 4 + 2] - p->sprite_h_offset;
+        u8 y = p->oam[spr * 4 + 3] - p->sprite_v_offset;
 
         // Check layer flag
         u8 base_priority = (info & 0x10) ? 5 : 1;
@@ -1418,138 +3767,615 @@ void scanline(interp *I, int line_num) {
             continue;
         }
 
-        // get the appropriate row of the tile (4 bytes)
-        u8 *sprite_bytes = &I->ppu->pattern_table[idx * SPRITE_BYTES
-                                                + sprite_row * (SPRITE_BYTES / SPRITE_HEIGHT)];
-
-        // SPRITE_BYTES / SPRITE_HEIGHT = # of bytes per sprite row.
-        // so i iterates over each byte of this row of the sprite.
-        for (int i = 0; i < SPRITE_BYTES / SPRITE_HEIGHT; i++) {
-            // 8 / N_PIXEL_BITS = how many pixels are packed into
-            // a byte. so j iterates over each pixel of the current
-            // sprite byte
-            for (int j = 0; j < 8 / N_PIXEL_BITS; j++) {
-                // ~0 = all 1's; ~0 << NPB = all 1's except w/ NPB 0's at the end
-                // ~(~0 << NPB) = all 0's but with NPB 1's at the end
-                u8 mask = ~(~0 << N_PALETTE_BITS);
-                // to mask out priority bits
-                u8 priority_mask = ~(~0 << N_PRIORITY_BITS);
-                // if j = 0, for instance, we want this offset to give us the *high*
-                // bits of the byte
-                u8 pixel_offset = 8 - (j + 1) * N_PIXEL_BITS;
-                u8 coloridx = (sprite_bytes[i] >> pixel_offset) & mask;
-
-                u8 priority_val = ((sprite_bytes[i] >> pixel_offset) >> N_PALETTE_BITS) & priority_mask;
-
-                u8 pixelx;
-                if (!horiz_flip) {
-                    // calculate our x position. also mod by 256 so we wrap around
-                    pixelx = (x + i * (8 / N_PIXEL_BITS) + j) % 256;
-                } else {
-                    // calculate our x position but do it backwards tile-wise
-                    pixelx = (x + 7 - (i * (8 / N_PIXEL_BITS) + j)) % 256;
-                }
+        const u8 *pixels = pattern_row(p, idx, sprite_row, horiz_flip);
 
-                if (pixelx >= 0 && pixelx < SCRW && coloridx != 0
-                        && base_priority + priority_val * 2 > line_priorities[pixelx]) {
-                    line_colors[pixelx] = sprite_palettes[palette][coloridx];
-                    line_priorities[pixelx] = base_priority + priority_val * 2;
-                }
+        for (int i = 0; i < SPRITE_WIDTH; i++) {
+            // mod by 256 so we wrap around
+            u8 pixelx = (x + i) % 256;
+            u8 coloridx = pixels[i] % N_COLORS;
+            u8 priority = base_priority + (pixels[i] / N_COLORS) * 2;
+
+            if (coloridx != 0 && priority > L.spr_pri[pixelx]) {
+                L.spr_col[pixelx] = (N_PALETTES + palette) * N_COLORS + coloridx;
+                L.spr_pri[pixelx] = priority;
             }
         }
     }
 
     // Front tile layer
-    // Which row of tiles are we drawing?
-    int fg_row_num = (((line_num + I->ppu->fg_v_offset) / 8) % 32 + 32) % 32;
-    // Which row of that row are we drawing? (i.e. y=0-7)
-    u8 fg_tile_row = ((line_num + I->ppu->fg_v_offset) % 8 + 8) % 8;
-    for (int t = 0; t < row_width; t++) {
-        // Get the bytes that describe our tile
-        u8 info = I->ppu->fg_map_data[fg_row_num * row_width * 2 + t * 2];
-        u16 idx = I->ppu->fg_map_data[fg_row_num * row_width * 2 + t * 2 + 1];
+    tile_layer(p, 1, p->fg_h_offset, p->fg_v_offset,
+               line_num, L.fg_col, L.fg_pri);
 
-        int horiz_flip = 0, vert_flip = 0;
-        if (info & 0x1) idx += 256;
-        if (info & 0x4) vert_flip = 1;
-        if (info & 0x8) horiz_flip = 1;
+    composite_line(&L, &p->palette_colors[0][0],
+                   &framebuffer[line_num * SCRW], SCRW);
+}
 
-        u8 palette = (info & 0xe0) >> 5;
+void scanline(ppu *p, int line_num) {
+    if (start_line(p, line_num)) {
+        prepare_line(p, line_num);
+        render_line(p, line_num);
+    }
+}
 
-        u8 tile_row = vert_flip ? 7 - fg_tile_row : fg_tile_row;
-
-        // get the appropriate row of the tile (4 bytes)
-        u8 *tile_bytes = &I->ppu->pattern_table[idx * SPRITE_BYTES
-                                                + tile_row * (SPRITE_BYTES / SPRITE_HEIGHT)];
-
-        int x = t * SPRITE_WIDTH - I->ppu->fg_h_offset;
-
-        // SPRITE_BYTES / SPRITE_HEIGHT = # of bytes per sprite row.
-        // so i iterates over each byte of this row of the sprite.
-        for (int i = 0; i < SPRITE_BYTES / SPRITE_HEIGHT; i++) {
-            // 8 / N_PIXEL_BITS = how many pixels are packed into
-            // a byte. so j iterates over each pixel of the current
-            // sprite byte
-            for (int j = 0; j < 8 / N_PIXEL_BITS; j++) {
-                // ~0 = all 1's; ~0 << NPB = all 1's except w/ NPB 0's at the end
-                // ~(~0 << NPB) = all 0's but with NPB 1's at the end
-                u8 mask = ~(~0 << N_PALETTE_BITS);
-                // mask out priority bits
-                u8 priority_mask = ~(~0 << N_PRIORITY_BITS);
-                // if j = 0, for instance, we want this offset to give us the *high*
-                // bits of the byte
-                u8 pixel_offset = 8 - (j + 1) * N_PIXEL_BITS;
-                u8 coloridx = (tile_bytes[i] >> pixel_offset) & mask;
-
-                u8 priority_val = ((tile_bytes[i] >> pixel_offset) >> N_PALETTE_BITS) & priority_mask;
-
-                u8 pixelx;
-                if (!horiz_flip) {
-                    // calculate our x position. also mod by 256 so we wrap around
-                    pixelx = (x + i * (8 / N_PIXEL_BITS) + j) % 256;
-                } else {
-                    // calculate our x position but do it backwards tile-wise
-                    pixelx = (x + 7 - (i * (8 / N_PIXEL_BITS) + j)) % 256;
-                }
+/*
+ * Parallel lines (--render-workers <n>)
+ *
+ * A line only depends on the PPU state at the time it ends, so while
+ * nothing gets written to the PPU, the lines that end don't have to be
+ * drawn straight away: draw_line just adds them to p's pending ones.
+ * The first write to the PPU (see ppu_store), or the end of the frame,
+ * flushes them, and if there are enough of them they get split
+ * between render_workers threads, each drawing its own rows of the
+ * framebuffer. So a frame nobody touches mid-frame gets drawn all in
+ * one go at the end, in parallel; one with HBLANK effects gets drawn
+ * a few lines (or one line) at a time, as before.
+ */
+
+// threads that draw lines, counting whichever one flushes (0 or 1 for
+// no parallel lines)
+int render_workers = 0;
+
+// fewer lines than this aren't worth waking the workers up for
+#define PARALLEL_MIN_LINES 16
+
+typedef struct line_job {
+    ppu *p;
+    // every n'th line of lines, starting from the worker's number
+    const u8 *lines;
+    int n_lines;
+    int n;
+} line_job;
+
+line_job current_job;
+SDL_Thread *worker_threads[MAX_RENDER_WORKERS];
+SDL_sem *worker_start[MAX_RENDER_WORKERS];
+SDL_sem *workers_done;
+
+static void do_line_job(const line_job *job, int worker) {
+    for (int i = worker; i < job->n_lines; i += job->n) {
+        render_line(job->p, job->lines[i]);
+    }
+}
 
+int worker_main(void *data) {
+    int worker = (int)(intptr_t)data;
+    for (;;) {
+        SDL_SemWait(worker_start[worker]);
+        if (!current_job.p) {
+            return 0;
+        }
+        do_line_job(&current_job, worker);
+        SDL_SemPost(workers_done);
+    }
+}
 
-                if (pixelx >= 0 && pixelx < SCRW && coloridx != 0
-                        && line_priorities[pixelx] < 4 + priority_val * 2) {
-                    line_colors[pixelx] = tile_palettes[palette][coloridx];
-                    line_priorities[pixelx] = 4 + priority_val * 2;
-                }
-            }
+void start_render_workers(int n) {
+    if (n > MAX_RENDER_WORKERS) {
+        n = MAX_RENDER_WORKERS;
+    }
+    workers_done = SDL_CreateSemaphore(0);
+    // (worker 0 is whoever calls flush_lines)
+    render_workers = 1;
+    for (int i = 1; i < n; i++) {
+        worker_start[i] = SDL_CreateSemaphore(0);
+        worker_threads[i] = SDL_CreateThread(worker_main, "render worker", (void *)(intptr_t)i);
+        if (!worker_threads[i]) {
+            fprintf(stderr, "Unable to start render worker: %s\n", SDL_GetError());
+            SDL_DestroySemaphore(worker_start[i]);
+            break;
+        }
+        render_workers++;
+    }
+}
+
+void stop_render_workers() {
+    current_job.p = NULL;
+    for (int i = 1; i < render_workers; i++) {
+        SDL_SemPost(worker_start[i]);
+        SDL_WaitThread(worker_threads[i], NULL);
+        SDL_DestroySemaphore(worker_start[i]);
+    }
+    SDL_DestroySemaphore(workers_done);
+    render_workers = 0;
+}
+
+void flush_lines(ppu *p) {
+    // Draw the pending lines, as the PPU is now.
+    u8 lines[MAX_SCRH];
+    int n_lines = 0;
+
+    for (int line = p->pending_from; line < p->pending_to; line++) {
+        if (start_line(p, line)) {
+            prepare_line(p, line);
+            lines[n_lines++] = line;
+        }
+    }
+    p->pending_from = p->pending_to = 0;
+
+    if (n_lines < PARALLEL_MIN_LINES || render_workers < 2) {
+        for (int i = 0; i < n_lines; i++) {
+            render_line(p, lines[i]);
+        }
+        return;
+    }
+
+    // sprites decode their pattern rows as they go, which can't happen
+    // on several threads at once, so get that done first
+    for (int r = 0; r < 512 * SPRITE_HEIGHT; r++) {
+        if (p->pattern_dirty[r]) {
+            decode_pattern_row(p, r);
         }
     }
 
-    for (int i = 0; i < SCRW; i++) {
-        u8 r = (line_colors[i] >> 16) & 0xff;
-        u8 g = (line_colors[i] >>  8) & 0xff;
-        u8 b = (line_colors[i] >>  0) & 0xff;
-        SDL_SetRenderDrawColor(renderer, r, g, b, 255);
-        SDL_RenderDrawPoint(renderer, i, line_num);
+    current_job = (line_job){ p, lines, n_lines, render_workers };
+    for (int i = 1; i < render_workers; i++) {
+        SDL_SemPost(worker_start[i]);
+    }
+    do_line_job(&current_job, 0);
+    for (int i = 1; i < render_workers; i++) {
+        SDL_SemWait(workers_done);
+    }
+}
+
+void draw_line(ppu *p, int line_num) {
+    // The line that just ended: draw it now, or leave it for
+    // flush_lines if we're doing that.
+    if (!render_workers) {
+        scanline(p, line_num);
+        return;
+    }
+    if (p->pending_to != line_num) {
+        flush_lines(p);
+        p->pending_from = line_num;
     }
+    p->pending_to = line_num + 1;
 }
 
-void draw(interp *I) {
-    SDL_SetRenderTarget(renderer, texture);
-    SDL_RenderClear(renderer);
+void finish_frame(ppu *p) {
+    if (p->pending_to) {
+        flush_lines(p);
+    }
+}
 
-    for (int y = 0; y < SCRH; y++) {
-        scanline(I, y);
-        if (interrupt(I, HBLANK_INTERRUPT)) {
-            while (!(I->flags & INTERRUPT_ENABLE_NEXT) && (I->flags & RUN_FLAG)) {
-                do_instr(I);
-            }
-            I->flags |= INTERRUPT_ENABLE;
-            I->flags &= ~INTERRUPT_ENABLE_NEXT;
+void run_line_bench(interp *I, long count) {
+    // Let the program set up its screen first (no video, no
+    // interrupts, until it waits for one), then draw count lines with
+    // each way of compositing we have and say how long a line took.
+    long n = 0;
+    I->cycle_limit = (u64)-1;
+    while (n < 10000000 && (I->flags & RUN_FLAG) && !(I->flags & WAIT_FLAG)) {
+        n += cpu_step(I, (u64)-1);
+    }
+
+    struct {
+        const char *name;
+        composite_fn fn;
+    } paths[] = {
+        { "scalar", composite_scalar },
+#if defined(__x86_64__)
+        { "sse2", composite_sse2 },
+        { "avx2", SDL_HasAVX2() ? composite_avx2 : NULL },
+#endif
+    };
+    static u32 expected[MAX_SCRW * MAX_SCRH];
+    composite_fn picked = composite_line;
+
+    for (int i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        if (!paths[i].fn) {
+            continue;
+        }
+        composite_line = paths[i].fn;
+
+        // one frame to check against the scalar one
+        for (int line = 0; line < SCRH; line++) {
+            scanline(I->ppu, line);
+        }
+        int same = 1;
+        if (i == 0) {
+            memcpy(expected, framebuffer, sizeof(framebuffer));
+        } else {
+            same = !memcmp(expected, framebuffer, SCRW * SCRH * sizeof(u32));
         }
+
+        u64 start = SDL_GetPerformanceCounter();
+        for (long k = 0; k < count; k++) {
+            // (or nothing would change, and it'd skip them all)
+            I->ppu->screen_changed = 1;
+            scanline(I->ppu, k % SCRH);
+        }
+        double secs = (double)(SDL_GetPerformanceCounter() - start)
+                        / SDL_GetPerformanceFrequency();
+
+        printf("%-6s %8.1f ns/line%s\n", paths[i].name,
+               secs * 1e9 / count, same ? "" : " (DOESN'T MATCH SCALAR)");
+    }
+
+    composite_line = picked;
+
+    if (render_workers > 1) {
+        // whole frames at a time, split between the workers
+        ppu *p = I->ppu;
+        u64 start = SDL_GetPerformanceCounter();
+        long frames = (count + SCRH - 1) / SCRH;
+        for (long f = 0; f < frames; f++) {
+            p->screen_changed = 1;
+            p->pending_from = 0;
+            p->pending_to = SCRH;
+            flush_lines(p);
+        }
+        double secs = (double)(SDL_GetPerformanceCounter() - start)
+                        / SDL_GetPerformanceFrequency();
+        int same = !memcmp(expected, framebuffer, SCRW * SCRH * sizeof(u32));
+
+        printf("%d workers: %8.1f ns/line%s\n", render_workers,
+               secs * 1e9 / (frames * SCRH), same ? "" : " (DOESN'T MATCH SCALAR)");
     }
-    SDL_SetRenderTarget(renderer, NULL);
+}
+
+void present_frame() {
+    // One upload of the whole picture, then onto the screen.
+    SDL_UpdateTexture(texture, NULL, framebuffer, SCRW * sizeof(u32));
     SDL_RenderCopy(renderer, texture, NULL, NULL);
     SDL_RenderPresent(renderer);
 }
 
+/*
+ * Scheduler
+ *
+ * Everything that happens at a particular time (in cycles) rather
+ * than because of an instruction is an event in event_queue, a heap
+ * ordered by when. The main loop runs the CPU up to the first one,
+ * runs whatever's due, and goes again; each event schedules the
+ * next one of its kind. There's at most one of each kind waiting, so
+ * the queue never holds more than N_EVENTS.
+ */
+
+// room for one of each kind (N_EVENTS), and a few spare
+#define MAX_EVENTS 8
+
+event event_queue[MAX_EVENTS];
+int n_events = 0;
+
+// the line the video's on
+int video_line = 0;
+
+static int event_before(const event *a, const event *b) {
+    // (same time: lower kind first, so the order never depends on
+    // the order they were scheduled in)
+    return a->when < b->when || (a->when == b->when && a->kind < b->kind);
+}
+
+void schedule(u8 kind, u64 when) {
+    int i = n_events++;
+    event e = { when, kind };
+    while (i > 0 && event_before(&e, &event_queue[(i - 1) / 2])) {
+        event_queue[i] = event_queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    event_queue[i] = e;
+}
+
+void cancel_event(u8 kind) {
+    // Take any event of this kind out of the queue.
+    event rest[MAX_EVENTS];
+    int n = 0;
+    for (int i = 0; i < n_events; i++) {
+        if (event_queue[i].kind != kind) {
+            rest[n++] = event_queue[i];
+        }
+    }
+    n_events = 0;
+    for (int i = 0; i < n; i++) {
+        schedule(rest[i].kind, rest[i].when);
+    }
+}
+
+event next_event() {
+    // Take the first event off the queue.
+    event first = event_queue[0];
+    event last = event_queue[--n_events];
+    int i = 0;
+    for (;;) {
+        int child = i * 2 + 1;
+        if (child >= n_events) {
+            break;
+        }
+        if (child + 1 < n_events && event_before(&event_queue[child + 1], &event_queue[child])) {
+            child++;
+        }
+        if (!event_before(&event_queue[child], &last)) {
+            break;
+        }
+        event_queue[i] = event_queue[child];
+        i = child;
+    }
+    event_queue[i] = last;
+    return first;
+}
+
+void poll_window(interp *I) {
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+        // quit when we close the window
+        // otherwise infinite loops become terrible
+        if (event.type == SDL_QUIT) {
+            I->flags &= ~RUN_FLAG;
+        } else if (event.type == SDL_WINDOWEVENT
+                && event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+            // the window needs repainting, so draw the next
+            // frame even if nothing's changed
+            if (threaded_ppu) {
+                ring_push(RING_REDRAW);
+            } else {
+                I->ppu->screen_changed = 1;
+            }
+        } else if (event.type == SDL_KEYDOWN) {
+            // Later we'll have a 'controller mode' as well.
+            // For now, we just have a keyboard.
+            handle_keydown(I, event.key);
+        }
+    }
+}
+
+void run_event(interp *I, event e) {
+    switch (e.kind) {
+        case EV_POLL:
+            // look at the window (and deliver any keys) every
+            // slice_size cycles
+            poll_window(I);
+            schedule(EV_POLL, I->cycles + slice_size);
+            break;
+        case EV_LINE:
+            end_line(I, video_line);
+            video_line = (video_line + 1) % LINES_PER_FRAME;
+            schedule(EV_LINE, e.when + CYCLES_PER_LINE);
+            break;
+        case EV_TIMER:
+            raise_irq(I, IRQ_TIMER);
+            if (I->timer_ctrl & TIMER_REPEAT) {
+                // (from when it was due, so it doesn't drift)
+                start_timer(I, e.when);
+            } else {
+                I->timer_ctrl &= ~TIMER_RUN;
+                I->timer_count = 0;
+            }
+            break;
+    }
+}
+
+/*
+ * Timer
+ */
+
+void start_timer(interp *I, u64 from) {
+    // Count down from the reload value (0 means 65536), starting at
+    // cycle from.
+    u32 ticks = I->timer_reload ? I->timer_reload : 0x10000;
+    I->timer_due = from + (u64)ticks * TIMER_PRESCALE(I->timer_ctrl);
+    schedule(EV_TIMER, I->timer_due);
+    // if we're partway through a slice that would've gone past it,
+    // stop the slice there instead
+    if (I->timer_due < I->cycle_limit) {
+        I->cycle_limit = I->timer_due;
+    }
+}
+
+u16 timer_count(interp *I) {
+    if (!(I->timer_ctrl & TIMER_RUN)) {
+        return I->timer_count;
+    }
+    // ticks left, rounding up (it's 0 only once it's due)
+    u32 scale = TIMER_PRESCALE(I->timer_ctrl);
+    u64 left = I->timer_due > I->cycles ? I->timer_due - I->cycles : 0;
+    return (left + scale - 1) / scale;
+}
+
+void timer_control(interp *I, u8 value) {
+    // Stop the timer where it is, then start it again from the reload
+    // value if TIMER_RUN is set.
+    I->timer_count = timer_count(I);
+    cancel_event(EV_TIMER);
+    I->timer_ctrl = value & 0x0f;
+    if (value & TIMER_RUN) {
+        start_timer(I, I->cycles);
+    }
+}
+
+void end_line(interp *I, int line_num) {
+    // Called every CYCLES_PER_LINE cycles, with which line just ended.
+    if (line_num < SCRH) {
+        // draw it (or have the render thread draw it), then give the
+        // program a chance to mess with the PPU before the next one
+        if (threaded_ppu) {
+            ring_mark(RING_LINE | line_num);
+        } else {
+            draw_line(I->ppu, line_num);
+        }
+        u8 ctrl = I->ppu->hblank_ctrl;
+        if ((ctrl & HBLANK_ENABLE)
+                && (!(ctrl & HBLANK_COMPARE) || I->ppu->hblank_line == line_num)) {
+            raise_irq(I, IRQ_HBLANK);
+        }
+    } else if (line_num == SCRH) {
+        // first line of vertical blank: show what we drew, unless it's
+        // the same as what's up there already
+        ppu *drawn = I->ppu;
+        if (threaded_ppu) {
+            ring_mark(RING_FRAME);
+            SDL_SemWait(frame_done);
+            drawn = render_ppu;
+        } else {
+            finish_frame(drawn);
+        }
+        if (drawn->lines_drawn) {
+            present_frame();
+        } else {
+            frames_skipped++;
+        }
+        raise_irq(I, IRQ_VBLANK);
+        pace_frame();
+    }
+}
+
+/*
+ * Threaded rendering (--threaded-ppu)
+ *
+ * The CPU thread keeps its own ppu, for reads, but ppu_write also puts
+ * every write to video memory into a ring, in between "line N ended"
+ * entries from end_line. The render thread replays the ring in order
+ * onto a copy of the ppu (render_ppu), drawing each line when it gets
+ * to its entry. So every line comes out just like it would on one
+ * thread, mid-frame changes and all. At the end of a frame end_line
+ * waits for the render thread to catch up before presenting, and
+ * that's the only time the CPU thread waits for it.
+ *
+ * The CPU thread only tells the render thread about new entries when
+ * it adds a marker, so a line's writes go across in one go.
+ */
+
+// Big enough for a frame's worth of writes (a store takes at least 4
+// cycles and writes at most 2 bytes) plus the markers, so the CPU
+// thread never runs out of room before the end-of-frame wait. DMA can
+// go past that; then ring_push waits for the render thread.
+#define RING_SIZE (1 << 17)
+
+u32 ring[RING_SIZE];
+// where the CPU thread has told the render thread it's up to, and
+// where the render thread has got to
+SDL_atomic_t ring_head;
+SDL_atomic_t ring_tail;
+// where the CPU thread is really up to
+u32 ring_fill = 0;
+
+SDL_sem *ring_ready;
+SDL_sem *frame_done;
+SDL_Thread *render_thread;
+ppu *render_ppu;
+
+void ring_push(u32 entry) {
+    while (ring_fill - (u32)SDL_AtomicGet(&ring_tail) >= RING_SIZE) {
+        // Only DMA gets this far ahead (a frame of plain writes fits).
+        // dma_run hands over a piece at a time, so nearly all of the
+        // ring is the render thread's to get through, and it'll make
+        // room.
+        SDL_Delay(1);
+    }
+    ring[ring_fill % RING_SIZE] = entry;
+    ring_fill++;
+}
+
+void ring_publish() {
+    // Let the render thread have everything pushed so far.
+    SDL_AtomicSet(&ring_head, ring_fill);
+    SDL_SemPost(ring_ready);
+}
+
+void ring_mark(u32 marker) {
+    ring_push(marker);
+    ring_publish();
+}
+
+int render_main(void *data) {
+    u32 tail = 0;
+    // the bytes of a DMA transfer, unpacked
+    static u8 dma_bytes[DMA_RING_CHUNK];
+
+    for (;;) {
+        SDL_SemWait(ring_ready);
+        u32 head = SDL_AtomicGet(&ring_head);
+
+        while (tail != head) {
+            u32 entry = ring[tail % RING_SIZE];
+            tail++;
+
+            if (entry >= 0xc000 << 8) {
+                ppu_store(render_ppu, entry >> 8, entry & 0xff);
+            } else if (entry < RING_FRAME) {
+                draw_line(render_ppu, entry & 0xff);
+            } else if (entry == RING_FRAME) {
+                finish_frame(render_ppu);
+                SDL_AtomicSet(&ring_tail, tail);
+                SDL_SemPost(frame_done);
+            } else if (entry == RING_REDRAW) {
+                render_ppu->screen_changed = 1;
+            } else if ((entry & ~0xffff) == RING_DMA
+                       || (entry & ~0xffff) == RING_FILL) {
+                // (dma_run publishes a whole piece at once)
+                u32 where = ring[tail % RING_SIZE];
+                tail++;
+                u32 len = where & 0xffff;
+                if ((entry & ~0xffff) == RING_FILL) {
+                    ppu_dma(render_ppu, (entry >> 8) & 0xff, where >> 16,
+                            NULL, entry & 0xff, len);
+                    continue;
+                }
+                for (u32 i = 0; i < len; i += 4) {
+                    u32 bytes = ring[tail % RING_SIZE];
+                    tail++;
+                    for (u32 j = 0; j < 4 && i + j < len; j++) {
+                        dma_bytes[i + j] = bytes >> (24 - 8 * j);
+                    }
+                }
+                ppu_dma(render_ppu, entry & 0xff, where >> 16, dma_bytes, 0, len);
+            } else {
+                // RING_QUIT
+                return 0;
+            }
+        }
+        SDL_AtomicSet(&ring_tail, tail);
+    }
+}
+
+int start_render_thread(ppu *p) {
+    // Start drawing on another thread, from a copy of p as it is now.
+    render_ppu = malloc(sizeof(ppu));
+    memcpy(render_ppu, p, sizeof(ppu));
+
+    SDL_AtomicSet(&ring_head, 0);
+    SDL_AtomicSet(&ring_tail, 0);
+    ring_fill = 0;
+    ring_ready = SDL_CreateSemaphore(0);
+    frame_done = SDL_CreateSemaphore(0);
+
+    render_thread = SDL_CreateThread(render_main, "render", NULL);
+    if (!render_thread) {
+        fprintf(stderr, "Unable to start render thread: %s\n", SDL_GetError());
+        free(render_ppu);
+        return 0;
+    }
+    return 1;
+}
+
+void stop_render_thread() {
+    ring_mark(RING_QUIT);
+    SDL_WaitThread(render_thread, NULL);
+    SDL_DestroySemaphore(ring_ready);
+    SDL_DestroySemaphore(frame_done);
+    free(render_ppu);
+    threaded_ppu = 0;
+}
+
+void pace_frame() {
+    // Keep us at FRAMES_PER_SECOND in real time. This is the only place
+    // the host clock gets a say, and all it can do is sleep, so the
+    // program sees exactly the same thing however fast we really are.
+    u32 now = SDL_GetTicks();
+
+    if (pace_frames == 0) {
+        pace_start = now;
+    }
+    pace_frames++;
+
+    u32 due = pace_start + (u32)(pace_frames * 1000 / FRAMES_PER_SECOND);
+    if ((i32)(due - now) > 0) {
+        SDL_Delay(due - now);
+    } else if ((i32)(now - due) > 250) {
+        // way behind (or we sat in the debugger for a while), so
+        // don't try to catch up
+        pace_frames = 0;
+    }
+}
+
 void init_ppu(ppu *p) {
     p->sprite_h_offset = 0;
     p->sprite_v_offset = 0;
@@ -1558,22 +4384,49 @@ void init_ppu(ppu *p) {
     p->fg_h_offset = 0;
     p->fg_v_offset = 0;
 
+    // every line, like before there was a choice
+    p->hblank_ctrl = HBLANK_ENABLE;
+    p->hblank_line = 0;
+
     for (int i = 0; i < 256; i++) {
         p->palette_data[i] = 0xFF;
     }
+    for (int i = 0; i < N_PALETTES * 2 * N_COLORS; i++) {
+        p->palette_dirty[i] = 1;
+    }
+    p->palette_gen = 1;
+    p->palette_seen = 0;
 
     for (int i = 0; i < 2048; i++) {
         p->bg_map_data[i] = 0xFF;
         p->fg_map_data[i] = 0xFF;
     }
+    for (int i = 0; i < 32 * 32; i++) {
+        p->cell_dirty[0][i] = 1;
+        p->cell_dirty[1][i] = 1;
+    }
 
     for (int i = 0; i < 1024; i++) {
         p->oam[i] = 0x00;
     }
+    p->sprites_dirty = 1;
 
     p->pattern_offset = 0x00;
 
     for (int i = 0; i < 0x4000; i++) {
         p->pattern_table[i] = 0x00;
     }
+    for (int i = 0; i < 512 * SPRITE_HEIGHT; i++) {
+        p->pattern_dirty[i] = 1;
+    }
+    for (int i = 0; i < 512; i++) {
+        p->tile_gen[i] = 0;
+    }
+
+    p->screen_changed = 1;
+    p->redraw_frame = 1;
+    p->lines_drawn = 0;
+
+    p->pending_from = 0;
+    p->pending_to = 0;
 }